@@ -4,6 +4,9 @@
 #include <linux/device.h>
 #include <linux/kdev_t.h>
 #include <linux/uaccess.h>
+#include <linux/ktime.h>
+#include <linux/uio.h>
+#include <linux/version.h>
 
 #define DEV_MEM_SIZE 512
 
@@ -12,26 +15,40 @@
 #endif
 #define pr_fmt(fmt) "%s:" fmt,  __func__
 
+/* Data path events are reported through tracepoints (events/pcd in tracefs),
+   only the errors are printed to the kernel log. Informational messages are
+   pr_debug, build with DEBUG=1 (or use dynamic debug) to get them back */
+#define CREATE_TRACE_POINTS
+#include "pcd_trace.h"
+
 /* pseudo device's memory */
-char device_buffer[DEV_MEM_SIZE];
+static char device_buffer[DEV_MEM_SIZE];
 
-dev_t device_number;
+static dev_t device_number;
 
-struct cdev pcd_cdev;
+static struct cdev pcd_cdev;
 
-loff_t pcd_lseek(struct file *filp, loff_t offset, int whence)
+static loff_t pcd_lseek(struct file *filp, loff_t offset, int whence)
 {
-    pr_info("lseek requested\n");
-    pr_info("Current file position = %lld\n", filp->f_pos);
-
     loff_t tmp;
+    loff_t ret;
+    u64 start = 0;
+    bool traced;
+
+    /* sampled once, an event enabled meanwhile would report the time since boot */
+    traced = trace_pcd_lseek_enabled();
+    if (traced)
+    {
+        start = ktime_get_ns();
+    }
 
     switch(whence)
     {
         case SEEK_SET:
             if (offset > DEV_MEM_SIZE || offset < 0)
             {
-                return -EINVAL;
+                ret = -EINVAL;
+                goto out;
             }
             filp->f_pos = offset;
             break;
@@ -39,7 +56,8 @@ loff_t pcd_lseek(struct file *filp, loff_t offset, int whence)
             tmp = filp->f_pos + offset;
             if (tmp > DEV_MEM_SIZE || tmp < 0)
             {
-                return -EINVAL;
+                ret = -EINVAL;
+                goto out;
             }
             filp->f_pos += offset;
             break;
@@ -47,105 +65,162 @@ loff_t pcd_lseek(struct file *filp, loff_t offset, int whence)
             tmp = DEV_MEM_SIZE + offset;
             if (tmp > DEV_MEM_SIZE || tmp < 0)
             {
-                return -EINVAL;
+                ret = -EINVAL;
+                goto out;
             }
             filp->f_pos = DEV_MEM_SIZE + offset;
             break;
         default:
-            return -EINVAL;
+            ret = -EINVAL;
+            goto out;
     }
 
-    pr_info("New value of file position = %lld\n", filp->f_pos);
-    return filp->f_pos;
+    ret = filp->f_pos;
+
+out:
+    if (traced)
+    {
+        trace_pcd_lseek(MINOR(device_number), offset, whence, ret, ktime_get_ns() - start);
+    }
+    return ret;
 }
 
-ssize_t pcd_read(struct file *filp, char __user *buff, size_t count, loff_t * f_pos)
+/* read(), readv(), preadv2() and io_uring reads all end up here. Every segment
+   of a vectored request is served within this single call */
+static ssize_t pcd_read_iter(struct kiocb *iocb, struct iov_iter *to)
 {
-    pr_info("read requested for %zu bytes\n", count);
-    pr_info("Current file position = %lld\n", *f_pos);
+    loff_t pos = iocb->ki_pos;
+    size_t count = iov_iter_count(to);
+    size_t copied;
+    u64 start = 0;
+    bool traced;
+    ssize_t ret;
+
+    traced = trace_pcd_read_enabled();
+    if (traced)
+    {
+        start = ktime_get_ns();
+    }
+
+    /* pread() does not go through lseek, so the position may be past the end */
+    if (pos >= DEV_MEM_SIZE)
+    {
+        ret = 0;
+        goto out;
+    }
 
     /* Examin the count */
-    if ((*f_pos + count) > DEV_MEM_SIZE)
+    if ((pos + count) > DEV_MEM_SIZE)
     {
-        count = DEV_MEM_SIZE - *f_pos;
+        count = DEV_MEM_SIZE - pos;
     }
 
     /* Copy data from kernel space into user space */
-    if (copy_to_user(buff, &device_buffer[*f_pos], count))
+    copied = copy_to_iter(&device_buffer[pos], count, to);
+    if (!copied && count)
     {
-        return -EFAULT;
+        ret = -EFAULT;
+        goto out;
     }
 
     /* Update current file position */
-    *f_pos += count;
-
-    pr_info("Number of bytes succesfully read = %zu\n", count);
-    pr_info("Updated file position = %lld\n", *f_pos);
+    iocb->ki_pos += copied;
 
     /* Return number of bytes which have been succesfully read */
-    return count;
+    ret = copied;
+
+out:
+    if (traced)
+    {
+        trace_pcd_read(MINOR(device_number), pos, count, ret, ktime_get_ns() - start);
+    }
+    return ret;
 }
 
-ssize_t pcd_write(struct file *filp, const char __user *buff, size_t count, loff_t *f_pos)
+static ssize_t pcd_write_iter(struct kiocb *iocb, struct iov_iter *from)
 {
-    pr_info("Write requested for %zu bytes\n", count);
-    pr_info("Current file position = %lld\n", *f_pos);
+    loff_t pos = iocb->ki_pos;
+    size_t count = iov_iter_count(from);
+    size_t copied;
+    u64 start = 0;
+    bool traced;
+    ssize_t ret;
+
+    traced = trace_pcd_write_enabled();
+    if (traced)
+    {
+        start = ktime_get_ns();
+    }
 
     /* Examin the count */
-    if ((*f_pos + count) > DEV_MEM_SIZE)
+    if (pos >= DEV_MEM_SIZE)
+    {
+        count = 0;
+    }
+    else if ((pos + count) > DEV_MEM_SIZE)
     {
-        count = DEV_MEM_SIZE - *f_pos;
+        count = DEV_MEM_SIZE - pos;
     }
 
     if (!count)
     {
         pr_err("No space left on the device");
-        return -ENOMEM;
+        ret = -ENOMEM;
+        goto out;
     }
 
     /* Copy data from user space into kernel space */
-    if (copy_from_user(&device_buffer[*f_pos], buff, count))
+    copied = copy_from_iter(&device_buffer[pos], count, from);
+    if (!copied)
     {
-        return -EFAULT;
+        ret = -EFAULT;
+        goto out;
     }
 
     /* Update current file position */
-    *f_pos += count;
+    iocb->ki_pos += copied;
 
-    pr_info("Number of bytes succesfully written = %zu\n", count);
-    pr_info("Updated file position = %lld\n", *f_pos);
+    /* Return number of bytes which have been succesfully written */
+    ret = copied;
 
-    /* Return number of bytes which have been succesfully read */
-    return count;
+out:
+    if (traced)
+    {
+        trace_pcd_write(MINOR(device_number), pos, count, ret, ktime_get_ns() - start);
+    }
+    return ret;
 }
 
-int pcd_open(struct inode *inode, struct file *filp)
+static int pcd_open(struct inode *inode, struct file *filp)
 {
-    /* We do not implement this function because this driver is pseudo-char-driver */
-    pr_info("open was succesfull\n");
+    /* The data path never sleeps, so io_uring and RWF_NOWAIT requests can be
+       completed inline instead of being punted to a worker thread */
+    filp->f_mode |= FMODE_NOWAIT;
+
+    trace_pcd_open(MINOR(inode->i_rdev), filp->f_mode, 0);
     return 0;
 }
 
-int pcd_release(struct inode *inode, struct file *filp)
+static int pcd_release(struct inode *inode, struct file *filp)
 {
     /* We do not implement this function because this driver is pseudo-char-driver */
-    pr_info("release was succesfull\n");
+    trace_pcd_release(MINOR(inode->i_rdev));
     return 0;
 }
 
 /* File operations for the driver */
-struct file_operations pcd_fops = {
+static struct file_operations pcd_fops = {
     .open = pcd_open,
-    .read = pcd_read,
-    .write = pcd_write,
+    .read_iter = pcd_read_iter,
+    .write_iter = pcd_write_iter,
     .llseek = pcd_lseek,
     .release = pcd_release,
     .owner = THIS_MODULE
 };
 
-struct class *class_pcd;
+static struct class *class_pcd;
 
-struct device *device_pcd;
+static struct device *device_pcd;
 
 static int __init pcd_driver_init(void)
 {
@@ -159,7 +234,7 @@ static int __init pcd_driver_init(void)
         goto out;
     }
 
-    pr_info("%s : Device number <major>.<minor> = %d.%d\n", __func__, MAJOR(device_number), MINOR(device_number));
+    pr_debug("%s : Device number <major>.<minor> = %d.%d\n", __func__, MAJOR(device_number), MINOR(device_number));
 
     /* 2. Initialize a cdev structure */
     cdev_init(&pcd_cdev, &pcd_fops);
@@ -174,7 +249,11 @@ static int __init pcd_driver_init(void)
     }
 
     /*4. Create device class under /sys/class */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 4, 0)
+    class_pcd = class_create("ocd_class");
+#else
     class_pcd = class_create(THIS_MODULE, "ocd_class");
+#endif
     if (IS_ERR(class_pcd))
     {
         pr_err("Class creation failed\n");
@@ -191,7 +270,7 @@ static int __init pcd_driver_init(void)
         goto class_del;
     }
 
-    pr_info("Module init was succesfull\n");
+    pr_debug("Module init was succesfull\n");
 
     return 0;
 
@@ -218,7 +297,7 @@ static void __exit pcd_driver_cleanup(void)
     cdev_del(&pcd_cdev);
     unregister_chrdev_region(device_number, 1);
 
-    pr_info("Module unloaded\n");
+    pr_debug("Module unloaded\n");
 }
 
 module_init(pcd_driver_init);
@@ -5,12 +5,25 @@
 #include <linux/kdev_t.h>
 #include <linux/uaccess.h>
 #include <linux/kernel.h>
+#include <linux/mm.h>
+#include <linux/vmalloc.h>
+#include <linux/rwsem.h>
+#include <linux/mutex.h>
+#include <linux/ktime.h>
+#include <linux/uio.h>
+#include <linux/version.h>
 
 #ifdef pr_fmt
 #undef pr_fmt
 #endif
 #define pr_fmt(fmt) "%s:" fmt,  __func__
 
+/* Data path events are reported through tracepoints (events/pcd_n in tracefs),
+   only the errors are printed to the kernel log. Informational messages are
+   pr_debug, build with DEBUG=1 (or use dynamic debug) to get them back */
+#define CREATE_TRACE_POINTS
+#include "pcd_trace.h"
+
 #define NO_OF_DEVICES 4
 
 #define MEM_SIZE_MAX_PCDEV1 1024
@@ -18,19 +31,115 @@
 #define MEM_SIZE_MAX_PCDEV3 1024
 #define MEM_SIZE_MAX_PCDEV4 512
 
-/* pseudo device's memory */
-char device_buffer_pcdev1[MEM_SIZE_MAX_PCDEV1];
-char device_buffer_pcdev2[MEM_SIZE_MAX_PCDEV2];
-char device_buffer_pcdev3[MEM_SIZE_MAX_PCDEV3];
-char device_buffer_pcdev4[MEM_SIZE_MAX_PCDEV4];
+/* Read side slots of a device lock, see struct pcd_lock */
+#define PCD_LOCK_SLOTS 16
+
+struct pcd_lock_slot
+{
+    struct rw_semaphore sem;
+} ____cacheline_aligned_in_smp;
+
+/* Device lock. A reader takes only the slot of the CPU it runs on, so
+   readers on different CPUs do not write to a shared cache line and scale
+   with the number of CPUs. A writer takes every slot in turn, the mutex
+   keeps writers from interleaving. Unlike a percpu_rw_semaphore no writer
+   waits for an RCU grace period, and writers can try the lock */
+struct pcd_lock
+{
+    struct mutex write_lock;
+    struct pcd_lock_slot slots[PCD_LOCK_SLOTS];
+};
+
+static void pcd_lock_init(struct pcd_lock *lock)
+{
+    unsigned int i;
+
+    mutex_init(&lock->write_lock);
+    for (i = 0; i < PCD_LOCK_SLOTS; i++)
+    {
+        init_rwsem(&lock->slots[i].sem);
+    }
+}
+
+/* Takes the read side, the result is the slot for pcd_up_read(). The
+   reader may move to another CPU meanwhile, it keeps the slot it took */
+static unsigned int pcd_down_read(struct pcd_lock *lock)
+{
+    unsigned int slot = raw_smp_processor_id() % PCD_LOCK_SLOTS;
+
+    down_read(&lock->slots[slot].sem);
+    return slot;
+}
+
+static bool pcd_down_read_trylock(struct pcd_lock *lock, unsigned int *slot)
+{
+    *slot = raw_smp_processor_id() % PCD_LOCK_SLOTS;
+    return down_read_trylock(&lock->slots[*slot].sem);
+}
+
+static void pcd_up_read(struct pcd_lock *lock, unsigned int slot)
+{
+    up_read(&lock->slots[slot].sem);
+}
+
+static void pcd_down_write(struct pcd_lock *lock)
+{
+    unsigned int i;
+
+    mutex_lock(&lock->write_lock);
+    for (i = 0; i < PCD_LOCK_SLOTS; i++)
+    {
+        down_write_nest_lock(&lock->slots[i].sem, &lock->write_lock);
+    }
+}
+
+/* Fails instead of waiting for a reader or another writer */
+static bool pcd_down_write_trylock(struct pcd_lock *lock)
+{
+    unsigned int i;
+
+    if (!mutex_trylock(&lock->write_lock))
+    {
+        return false;
+    }
+
+    for (i = 0; i < PCD_LOCK_SLOTS; i++)
+    {
+        if (!down_write_trylock(&lock->slots[i].sem))
+        {
+            while (i--)
+            {
+                up_write(&lock->slots[i].sem);
+            }
+            mutex_unlock(&lock->write_lock);
+            return false;
+        }
+    }
+    return true;
+}
+
+static void pcd_up_write(struct pcd_lock *lock)
+{
+    unsigned int i;
+
+    for (i = 0; i < PCD_LOCK_SLOTS; i++)
+    {
+        up_write(&lock->slots[i].sem);
+    }
+    mutex_unlock(&lock->write_lock);
+}
 
 /* Device private data structure */
 struct pcdev_private_data
 {
-    char *buffer;
+    char *buffer; /* pseudo device's memory, allocated page aligned in pcd_driver_init */
     unsigned size;
     const char *serial_number;
     int perm;
+    /* Serializes writers of the device against each other and against
+       readers, readers do not block each other. Accesses through mmap()
+       are not covered by the lock */
+    struct pcd_lock lock;
     struct cdev cdev;
 };
 
@@ -48,30 +157,26 @@ struct pcdrv_private_data
 #define WRONLY 0x10
 #define RDWR 0x11
 
-struct pcdrv_private_data pcdrv_data =
+static struct pcdrv_private_data pcdrv_data =
 {
     .total_devices = NO_OF_DEVICES,
     .pcdev_data = {
         [0] = {
-            .buffer = device_buffer_pcdev1,
             .size = MEM_SIZE_MAX_PCDEV1,
             .serial_number = "PCDEV1XYZ123",
             .perm = RDONLY
         },
         [1] = {
-            .buffer = device_buffer_pcdev2,
             .size = MEM_SIZE_MAX_PCDEV2,
             .serial_number = "PCDEV2XYZ123",
             .perm = WRONLY
         },
         [2] = {
-            .buffer = device_buffer_pcdev2,
             .size = MEM_SIZE_MAX_PCDEV2,
             .serial_number = "PCDEV2XYZ123",
             .perm = RDWR
         },
         [3] = {
-            .buffer = device_buffer_pcdev3,
             .size = MEM_SIZE_MAX_PCDEV3,
             .serial_number = "PCDEV3XYZ123",
             .perm = RDWR
@@ -79,21 +184,29 @@ struct pcdrv_private_data pcdrv_data =
     }
 };
 
-loff_t pcd_lseek(struct file *filp, loff_t offset, int whence)
+static loff_t pcd_lseek(struct file *filp, loff_t offset, int whence)
 {
     loff_t tmp;
+    loff_t ret;
+    u64 start = 0;
+    bool traced;
     struct pcdev_private_data *pcdev_data = filp->private_data;
     int max_size = pcdev_data->size;
 
-    pr_info("lseek requested\n");
-    pr_info("Current file position = %lld\n", filp->f_pos);
+    /* sampled once, an event enabled meanwhile would report the time since boot */
+    traced = trace_pcd_lseek_enabled();
+    if (traced)
+    {
+        start = ktime_get_ns();
+    }
 
     switch(whence)
     {
         case SEEK_SET:
             if (offset > max_size || offset < 0)
             {
-                return -EINVAL;
+                ret = -EINVAL;
+                goto out;
             }
             filp->f_pos = offset;
             break;
@@ -101,7 +214,8 @@ loff_t pcd_lseek(struct file *filp, loff_t offset, int whence)
             tmp = filp->f_pos + offset;
             if (tmp > max_size || tmp < 0)
             {
-                return -EINVAL;
+                ret = -EINVAL;
+                goto out;
             }
             filp->f_pos += offset;
             break;
@@ -109,85 +223,171 @@ loff_t pcd_lseek(struct file *filp, loff_t offset, int whence)
             tmp = max_size + offset;
             if (tmp > max_size || tmp < 0)
             {
-                return -EINVAL;
+                ret = -EINVAL;
+                goto out;
             }
             filp->f_pos = max_size + offset;
             break;
         default:
-            return -EINVAL;
+            ret = -EINVAL;
+            goto out;
     }
 
-    pr_info("New value of file position = %lld\n", filp->f_pos);
-    return filp->f_pos;
+    ret = filp->f_pos;
+
+out:
+    if (traced)
+    {
+        trace_pcd_lseek(MINOR(pcdev_data->cdev.dev), offset, whence, ret, ktime_get_ns() - start);
+    }
+    return ret;
 }
 
-ssize_t pcd_read(struct file *filp, char __user *buff, size_t count, loff_t * f_pos)
+/* read(), readv(), preadv2() and io_uring reads all end up here. Every segment
+   of a vectored request is served within this single call */
+static ssize_t pcd_read_iter(struct kiocb *iocb, struct iov_iter *to)
 {
-    struct pcdev_private_data *pcdev_data = filp->private_data;
+    struct pcdev_private_data *pcdev_data = iocb->ki_filp->private_data;
     int max_size = pcdev_data->size;
+    loff_t pos = iocb->ki_pos;
+    size_t count = iov_iter_count(to);
+    size_t copied;
+    u64 start = 0;
+    bool traced;
+    unsigned int slot;
+    ssize_t ret;
+
+    traced = trace_pcd_read_enabled();
+    if (traced)
+    {
+        start = ktime_get_ns();
+    }
 
-    pr_info("read requested for %zu bytes\n", count);
-    pr_info("Current file position = %lld\n", *f_pos);
+    /* pread() does not go through lseek, so the position may be past the end */
+    if (pos >= max_size)
+    {
+        ret = 0;
+        goto out;
+    }
 
     /* Examin the count */
-    if ((*f_pos + count) > max_size)
+    if ((pos + count) > max_size)
+    {
+        count = max_size - pos;
+    }
+
+    /* Nowait requests (RWF_NOWAIT, inline io_uring submissions) must not
+       sleep on the lock, the caller retries them from a blocking context */
+    if (iocb->ki_flags & IOCB_NOWAIT)
+    {
+        if (!pcd_down_read_trylock(&pcdev_data->lock, &slot))
+        {
+            ret = -EAGAIN;
+            goto out;
+        }
+    }
+    else
     {
-        count = max_size - *f_pos;
+        slot = pcd_down_read(&pcdev_data->lock);
     }
 
     /* Copy data from kernel space into user space */
-    if (copy_to_user(buff, pcdev_data->buffer + (*f_pos), count))
+    copied = copy_to_iter(pcdev_data->buffer + pos, count, to);
+    pcd_up_read(&pcdev_data->lock, slot);
+
+    if (!copied && count)
     {
-        return -EFAULT;
+        ret = -EFAULT;
+        goto out;
     }
 
     /* Update current file position */
-    *f_pos += count;
-
-    pr_info("Number of bytes succesfully read = %zu\n", count);
-    pr_info("Updated file position = %lld\n", *f_pos);
+    iocb->ki_pos += copied;
 
     /* Return number of bytes which have been succesfully read */
-    return count;
+    ret = copied;
+
+out:
+    if (traced)
+    {
+        trace_pcd_read(MINOR(pcdev_data->cdev.dev), pos, count, ret, ktime_get_ns() - start);
+    }
+    return ret;
 }
 
-ssize_t pcd_write(struct file *filp, const char __user *buff, size_t count, loff_t *f_pos)
+static ssize_t pcd_write_iter(struct kiocb *iocb, struct iov_iter *from)
 {
-    struct pcdev_private_data *pcdev_data = filp->private_data;
+    struct pcdev_private_data *pcdev_data = iocb->ki_filp->private_data;
     int max_size = pcdev_data->size;
-
-    pr_info("Write requested for %zu bytes\n", count);
-    pr_info("Current file position = %lld\n", *f_pos);
+    loff_t pos = iocb->ki_pos;
+    size_t count = iov_iter_count(from);
+    size_t copied;
+    u64 start = 0;
+    bool traced;
+    ssize_t ret;
+
+    traced = trace_pcd_write_enabled();
+    if (traced)
+    {
+        start = ktime_get_ns();
+    }
 
     /* Examin the count */
-    if ((*f_pos + count) > max_size)
+    if (pos >= max_size)
+    {
+        count = 0;
+    }
+    else if ((pos + count) > max_size)
     {
-        count = max_size - *f_pos;
+        count = max_size - pos;
     }
 
     if (!count)
     {
         pr_err("No space left on the device");
-        return -ENOMEM;
+        ret = -ENOMEM;
+        goto out;
+    }
+
+    /* Nowait requests must not sleep on the lock, see pcd_read_iter() */
+    if (iocb->ki_flags & IOCB_NOWAIT)
+    {
+        if (!pcd_down_write_trylock(&pcdev_data->lock))
+        {
+            ret = -EAGAIN;
+            goto out;
+        }
+    }
+    else
+    {
+        pcd_down_write(&pcdev_data->lock);
     }
 
     /* Copy data from user space into kernel space */
-    if (copy_from_user(pcdev_data->buffer + (*f_pos), buff, count))
+    copied = copy_from_iter(pcdev_data->buffer + pos, count, from);
+    pcd_up_write(&pcdev_data->lock);
+
+    if (!copied)
     {
-        return -EFAULT;
+        ret = -EFAULT;
+        goto out;
     }
 
     /* Update current file position */
-    *f_pos += count;
+    iocb->ki_pos += copied;
 
-    pr_info("Number of bytes succesfully written = %zu\n", count);
-    pr_info("Updated file position = %lld\n", *f_pos);
+    /* Return number of bytes which have been succesfully written */
+    ret = copied;
 
-    /* Return number of bytes which have been succesfully read */
-    return count;
+out:
+    if (traced)
+    {
+        trace_pcd_write(MINOR(pcdev_data->cdev.dev), pos, count, ret, ktime_get_ns() - start);
+    }
+    return ret;
 }
 
-int check_permission(int dev_perm, int acc_mode)
+static int check_permission(int dev_perm, int acc_mode)
 {
     if (dev_perm == RDWR)
     {
@@ -205,7 +405,7 @@ int check_permission(int dev_perm, int acc_mode)
     return -EPERM;
 }
 
-int pcd_open(struct inode *inode, struct file *filp)
+static int pcd_open(struct inode *inode, struct file *filp)
 {
     int ret;
     int minor_n;
@@ -213,7 +413,6 @@ int pcd_open(struct inode *inode, struct file *filp)
 
     /* find out on which device file open  was attempted by the user space */
     minor_n = MINOR(inode->i_rdev);
-    pr_info("minor access = %d\n", minor_n);
 
     /* get device's private data structure */
     pcdev_data = container_of(inode->i_cdev, struct pcdev_private_data, cdev);
@@ -224,23 +423,67 @@ int pcd_open(struct inode *inode, struct file *filp)
     /* check permission */
     ret = check_permission(pcdev_data->perm, filp->f_mode);
 
-    (!ret) ? pr_info("open was succesfull\n") : pr_info("open was unsuccesfull\n");
+    /* Reads and writes can be served without sleeping, so io_uring and
+       RWF_NOWAIT requests are completed inline instead of in a worker thread */
+    filp->f_mode |= FMODE_NOWAIT;
+
+    trace_pcd_open(minor_n, filp->f_mode, ret);
     return ret;
 }
 
-int pcd_release(struct inode *inode, struct file *filp)
+static int pcd_mmap(struct file *filp, struct vm_area_struct *vma)
+{
+    struct pcdev_private_data *pcdev_data = filp->private_data;
+    unsigned long map_size = PAGE_ALIGN(pcdev_data->size);
+    unsigned long offset = vma->vm_pgoff << PAGE_SHIFT;
+    unsigned long len = vma->vm_end - vma->vm_start;
+
+    pr_debug("mmap requested for %lu bytes at offset %lu\n", len, offset);
+
+    /* The mapping has to fit into the (page aligned) device memory */
+    if (offset >= map_size || len > map_size - offset)
+    {
+        return -EINVAL;
+    }
+
+    /* Device permissions become VM protections. A write-only mapping cannot
+       be expressed by the MMU, so write-only devices cannot be mapped at all */
+    if (!(pcdev_data->perm & RDONLY))
+    {
+        return -EACCES;
+    }
+    if (!(pcdev_data->perm & WRONLY))
+    {
+        if (vma->vm_flags & VM_WRITE)
+        {
+            return -EACCES;
+        }
+        /* do not allow mprotect() to make the mapping writable later */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 3, 0)
+        vm_flags_clear(vma, VM_MAYWRITE);
+#else
+        vma->vm_flags &= ~VM_MAYWRITE;
+#endif
+    }
+
+    /* Map the device memory directly, user space accesses it without copies */
+    return remap_vmalloc_range(vma, pcdev_data->buffer, vma->vm_pgoff);
+}
+
+static int pcd_release(struct inode *inode, struct file *filp)
 {
     /* We do not implement this function because this driver is pseudo-char-driver */
-    pr_info("release was succesfull\n");
+    trace_pcd_release(MINOR(inode->i_rdev));
     return 0;
 }
 
 /* File operations for the driver */
-struct file_operations pcd_fops = {
+static struct file_operations pcd_fops = {
     .open = pcd_open,
-    .read = pcd_read,
-    .write = pcd_write,
+    .read_iter = pcd_read_iter,
+    .write_iter = pcd_write_iter,
     .llseek = pcd_lseek,
+    .mmap = pcd_mmap,
     .release = pcd_release,
     .owner = THIS_MODULE
 };
@@ -250,16 +493,35 @@ static int __init pcd_driver_init(void)
     int ret;
     int i;
 
+    /* Allocate device memory. It is page aligned and zeroed, so it can be
+       safely mapped into user space */
+    for (i = 0; i < NO_OF_DEVICES; ++i)
+    {
+        pcdrv_data.pcdev_data[i].buffer = vmalloc_user(PAGE_ALIGN(pcdrv_data.pcdev_data[i].size));
+        if (!pcdrv_data.pcdev_data[i].buffer)
+        {
+            pr_err("Cannot allocate memory\n");
+            ret = -ENOMEM;
+            goto free_buffers;
+        }
+
+        pcd_lock_init(&pcdrv_data.pcdev_data[i].lock);
+    }
+
     /* Dynamically allocate a device number */
     ret = alloc_chrdev_region(&pcdrv_data.device_number, 0, NO_OF_DEVICES, "pcd_devices");
     if (ret < 0)
     {
         pr_err("Alloc chrdev failed\n");
-        goto out;
+        goto free_buffers;
     }
 
     /* Create device class under /sys/class */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 4, 0)
+    pcdrv_data.class_pcd = class_create("pcd_class");
+#else
     pcdrv_data.class_pcd = class_create(THIS_MODULE, "pcd_class");
+#endif
     if (IS_ERR(pcdrv_data.class_pcd))
     {
         pr_err("Class creation failed\n");
@@ -269,7 +531,7 @@ static int __init pcd_driver_init(void)
 
     for (i = 0; i < NO_OF_DEVICES; ++i)
     {
-        pr_info("%s : Device number <major>.<minor> = %d.%d\n", __func__, MAJOR(pcdrv_data.device_number + i), MINOR(pcdrv_data.device_number + i));
+        pr_debug("%s : Device number <major>.<minor> = %d.%d\n", __func__, MAJOR(pcdrv_data.device_number + i), MINOR(pcdrv_data.device_number + i));
 
         /* Initialize a cdev structure */
         cdev_init(&pcdrv_data.pcdev_data[i].cdev, &pcd_fops);
@@ -293,7 +555,7 @@ static int __init pcd_driver_init(void)
         }
     }
 
-    pr_info("Module init was succesfull\n");
+    pr_debug("Module init was succesfull\n");
 
     return 0;
 
@@ -309,7 +571,12 @@ class_del:
 unreg_chrdev:
     unregister_chrdev_region(pcdrv_data.device_number, 1);
 
-out:
+free_buffers:
+    for (i = 0; i < NO_OF_DEVICES; ++i)
+    {
+        vfree(pcdrv_data.pcdev_data[i].buffer);
+    }
+
     pr_err("Module insertion failed\n");
     return ret;
 }
@@ -325,7 +592,12 @@ static void __exit pcd_driver_cleanup(void)
     class_destroy(pcdrv_data.class_pcd);
     unregister_chrdev_region(pcdrv_data.device_number, 1);
 
-    pr_info("Module unloaded\n");
+    for (i = 0; i < NO_OF_DEVICES; ++i)
+    {
+        vfree(pcdrv_data.pcdev_data[i].buffer);
+    }
+
+    pr_debug("Module unloaded\n");
 }
 
 module_init(pcd_driver_init);
@@ -0,0 +1,124 @@
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM pcd_n
+
+#if !defined(PCD_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define PCD_TRACE_H
+
+#include <linux/tracepoint.h>
+
+TRACE_EVENT(pcd_open,
+
+    TP_PROTO(unsigned int minor, fmode_t f_mode, int ret),
+
+    TP_ARGS(minor, f_mode, ret),
+
+    TP_STRUCT__entry(
+        __field(unsigned int, minor)
+        __field(unsigned int, f_mode)
+        __field(int, ret)
+    ),
+
+    TP_fast_assign(
+        __entry->minor = minor;
+        __entry->f_mode = (__force unsigned int)f_mode;
+        __entry->ret = ret;
+    ),
+
+    TP_printk("minor=%u f_mode=0x%x ret=%d",
+        __entry->minor, __entry->f_mode, __entry->ret)
+);
+
+/* read and write share the same layout */
+DECLARE_EVENT_CLASS(pcd_rw,
+
+    TP_PROTO(unsigned int minor, loff_t pos, size_t count, ssize_t ret, u64 latency_ns),
+
+    TP_ARGS(minor, pos, count, ret, latency_ns),
+
+    TP_STRUCT__entry(
+        __field(unsigned int, minor)
+        __field(loff_t, pos)
+        __field(size_t, count)
+        __field(ssize_t, ret)
+        __field(u64, latency_ns)
+    ),
+
+    TP_fast_assign(
+        __entry->minor = minor;
+        __entry->pos = pos;
+        __entry->count = count;
+        __entry->ret = ret;
+        __entry->latency_ns = latency_ns;
+    ),
+
+    TP_printk("minor=%u pos=%lld count=%zu ret=%zd latency_ns=%llu",
+        __entry->minor, __entry->pos, __entry->count, __entry->ret,
+        __entry->latency_ns)
+);
+
+DEFINE_EVENT(pcd_rw, pcd_read,
+
+    TP_PROTO(unsigned int minor, loff_t pos, size_t count, ssize_t ret, u64 latency_ns),
+
+    TP_ARGS(minor, pos, count, ret, latency_ns)
+);
+
+DEFINE_EVENT(pcd_rw, pcd_write,
+
+    TP_PROTO(unsigned int minor, loff_t pos, size_t count, ssize_t ret, u64 latency_ns),
+
+    TP_ARGS(minor, pos, count, ret, latency_ns)
+);
+
+TRACE_EVENT(pcd_lseek,
+
+    TP_PROTO(unsigned int minor, loff_t offset, int whence, loff_t ret, u64 latency_ns),
+
+    TP_ARGS(minor, offset, whence, ret, latency_ns),
+
+    TP_STRUCT__entry(
+        __field(unsigned int, minor)
+        __field(loff_t, offset)
+        __field(int, whence)
+        __field(loff_t, ret)
+        __field(u64, latency_ns)
+    ),
+
+    TP_fast_assign(
+        __entry->minor = minor;
+        __entry->offset = offset;
+        __entry->whence = whence;
+        __entry->ret = ret;
+        __entry->latency_ns = latency_ns;
+    ),
+
+    TP_printk("minor=%u offset=%lld whence=%d ret=%lld latency_ns=%llu",
+        __entry->minor, __entry->offset, __entry->whence, __entry->ret,
+        __entry->latency_ns)
+);
+
+TRACE_EVENT(pcd_release,
+
+    TP_PROTO(unsigned int minor),
+
+    TP_ARGS(minor),
+
+    TP_STRUCT__entry(
+        __field(unsigned int, minor)
+    ),
+
+    TP_fast_assign(
+        __entry->minor = minor;
+    ),
+
+    TP_printk("minor=%u", __entry->minor)
+);
+
+#endif // PCD_TRACE_H
+
+/* This part must be outside protection */
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE pcd_trace
+#include <trace/define_trace.h>
@@ -0,0 +1,191 @@
+/*
+ * Stress benchmark for the pcd_n driver.
+ *
+ * Runs an increasing number of reader threads (1, 2, 4, ... up to the number
+ * of online CPUs) against one device, optionally together with writer
+ * threads, and reports the aggregated read throughput for every step. With
+ * readers never blocking each other the throughput has to grow linearly with
+ * the number of reader threads.
+ *
+ * Build: gcc -O2 -Wall -pthread -o pcd_stress pcd_stress.c
+ * Usage: ./pcd_stress [-d device] [-t max_threads] [-s seconds] [-b block_size] [-w writers]
+ */
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <time.h>
+
+/* RDWR device, so readers and writers can share it */
+#define DEFAULT_DEVICE "/dev/pcdev-3"
+#define DEFAULT_SECONDS 2
+#define DEFAULT_BLOCK_SIZE 512
+
+struct worker {
+	pthread_t thread;
+	int fd;
+	int writer;
+	unsigned long long ops;
+	unsigned long long bytes;
+};
+
+static const char *device = DEFAULT_DEVICE;
+static size_t block_size = DEFAULT_BLOCK_SIZE;
+static volatile int running;
+
+static void *worker_fn(void *arg)
+{
+	struct worker *w = arg;
+	/* count locally, workers sit next to each other in memory */
+	unsigned long long ops = 0, bytes = 0;
+	char *buffer;
+	ssize_t ret;
+
+	buffer = malloc(block_size);
+	if (!buffer)
+		return NULL;
+	memset(buffer, 'x', block_size);
+
+	while (running) {
+		/* pread/pwrite keep the threads independent of the shared file position */
+		if (w->writer)
+			ret = pwrite(w->fd, buffer, block_size, 0);
+		else
+			ret = pread(w->fd, buffer, block_size, 0);
+
+		if (ret < 0) {
+			perror(w->writer ? "pwrite" : "pread");
+			break;
+		}
+		ops++;
+		bytes += ret;
+	}
+
+	w->ops = ops;
+	w->bytes = bytes;
+	free(buffer);
+	return NULL;
+}
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Runs one step and returns aggregated reader operations per second */
+static double run_step(int readers, int writers, int seconds, double *mbps)
+{
+	struct worker *workers;
+	unsigned long long ops = 0, bytes = 0;
+	double start, elapsed;
+	int total = readers + writers;
+	int i;
+
+	workers = calloc(total, sizeof(*workers));
+	if (!workers) {
+		perror("calloc");
+		exit(EXIT_FAILURE);
+	}
+
+	for (i = 0; i < total; i++) {
+		workers[i].writer = i >= readers;
+		workers[i].fd = open(device, workers[i].writer ? O_WRONLY : O_RDONLY);
+		if (workers[i].fd < 0) {
+			perror("open");
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	running = 1;
+	start = now();
+	for (i = 0; i < total; i++)
+		pthread_create(&workers[i].thread, NULL, worker_fn, &workers[i]);
+
+	sleep(seconds);
+	running = 0;
+
+	for (i = 0; i < total; i++)
+		pthread_join(workers[i].thread, NULL);
+	elapsed = now() - start;
+
+	for (i = 0; i < total; i++) {
+		if (!workers[i].writer) {
+			ops += workers[i].ops;
+			bytes += workers[i].bytes;
+		}
+		close(workers[i].fd);
+	}
+	free(workers);
+
+	*mbps = bytes / elapsed / (1024 * 1024);
+	return ops / elapsed;
+}
+
+int main(int argc, char *argv[])
+{
+	int max_threads = sysconf(_SC_NPROCESSORS_ONLN);
+	int seconds = DEFAULT_SECONDS;
+	int writers = 0;
+	double base = 0;
+	int opt, n;
+
+	while ((opt = getopt(argc, argv, "d:t:s:b:w:")) != -1) {
+		switch (opt) {
+		case 'd':
+			device = optarg;
+			break;
+		case 't':
+			max_threads = atoi(optarg);
+			break;
+		case 's':
+			seconds = atoi(optarg);
+			break;
+		case 'b':
+			block_size = strtoul(optarg, NULL, 0);
+			break;
+		case 'w':
+			writers = atoi(optarg);
+			break;
+		default:
+			printf("Correct usage: %s [-d device] [-t max_threads] [-s seconds] [-b block_size] [-w writers]\n", argv[0]);
+			return EXIT_FAILURE;
+		}
+	}
+
+	if (max_threads < 1 || seconds < 1 || !block_size || writers < 0) {
+		printf("Wrong arguments\n");
+		return EXIT_FAILURE;
+	}
+
+	printf("device %s, block size %zu, %d writer(s), %d s per step\n",
+	       device, block_size, writers, seconds);
+	printf("%8s %14s %10s %9s %11s\n", "readers", "read ops/s", "MiB/s", "speedup", "efficiency");
+
+	for (n = 1; ; n *= 2) {
+		double ops, mbps;
+
+		if (n > max_threads)
+			n = max_threads;
+
+		ops = run_step(n, writers, seconds, &mbps);
+		if (n == 1)
+			base = ops;
+
+		printf("%8d %14.0f %10.1f %8.2fx %10.1f%%\n",
+		       n, ops, mbps, ops / base, 100.0 * ops / base / n);
+		fflush(stdout);
+
+		if (n == max_threads)
+			break;
+	}
+
+	return 0;
+}
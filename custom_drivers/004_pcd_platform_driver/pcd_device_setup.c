@@ -6,7 +6,7 @@
 #define pr_fmt(fmt) "%s : " fmt, __func__
 
 /* 1. Create 2 platform data */
-struct pcdev_platform_data pcdev_pdata[] = {
+static struct pcdev_platform_data pcdev_pdata[] = {
     [0] = { .size = 512, .perm = RDWR, .serial_number = "PCDEVABC1111" },
     [1] = { .size = 1024, .perm = RDWR, .serial_number = "PCDEVXYZ2222" },
     [2] = { .size = 128, .perm = RDONLY, .serial_number = "PCDEVABC3333" },
@@ -15,12 +15,12 @@ struct pcdev_platform_data pcdev_pdata[] = {
 
 /* 2. Create 2 platform devices */
 
-void pcdev_release(struct device *dev)
+static void pcdev_release(struct device *dev)
 {
     pr_info("Device released\n");
 }
 
-struct platform_device platform_pcdev_1 = {
+static struct platform_device platform_pcdev_1 = {
     .name = "pcdev-A1x",
     .id = 0,
     .dev = {
@@ -29,7 +29,7 @@ struct platform_device platform_pcdev_1 = {
     }
 };
 
-struct platform_device platform_pcdev_2 = {
+static struct platform_device platform_pcdev_2 = {
     .name = "pcdev-B1x",
     .id = 1,
     .dev = {
@@ -38,7 +38,7 @@ struct platform_device platform_pcdev_2 = {
     }
 };
 
-struct platform_device platform_pcdev_3 = {
+static struct platform_device platform_pcdev_3 = {
     .name = "pcdev-C1x",
     .id = 2,
     .dev = {
@@ -47,7 +47,7 @@ struct platform_device platform_pcdev_3 = {
     }
 };
 
-struct platform_device platform_pcdev_4 = {
+static struct platform_device platform_pcdev_4 = {
     .name = "pcdev-D1x",
     .id = 3,
     .dev = {
@@ -56,7 +56,7 @@ struct platform_device platform_pcdev_4 = {
     }
 };
 
-struct platform_device *platform_devs[] = {
+static struct platform_device *platform_devs[] = {
     &platform_pcdev_1,
     &platform_pcdev_2,
     &platform_pcdev_3,
@@ -8,6 +8,11 @@
 #include <linux/platform_device.h>
 #include <linux/slab.h>
 #include <linux/mod_devicetable.h>
+#include <linux/vmalloc.h>
+#include <linux/rwsem.h>
+#include <linux/mutex.h>
+#include <linux/uio.h>
+#include <linux/version.h>
 #include "platform.h"
 
 #ifdef pr_fmt
@@ -30,7 +35,7 @@ enum pcdev_names
     PCDEVDX1
 };
 
-struct device_config pcdev_config[] = {
+static struct device_config pcdev_config[] = {
     [PCDEVAX1] = { .config_item1 = 60, .config_item2 = 21 },
     [PCDEVBX1] = { .config_item1 = 50, .config_item2 = 22 },
     [PCDEVCX1] = { .config_item1 = 40, .config_item2 = 23 },
@@ -38,7 +43,7 @@ struct device_config pcdev_config[] = {
 };
 
 /* the below table should be null terminated */
-struct platform_device_id pcdevs_ids[] = {
+static struct platform_device_id pcdevs_ids[] = {
     [0] = { .name = "pcdev-A1x", .driver_data = PCDEVAX1 },
     [1] = { .name = "pcdev-B1x", .driver_data = PCDEVBX1 },
     [2] = { .name = "pcdev-C1x", .driver_data = PCDEVCX1 },
@@ -46,11 +51,111 @@ struct platform_device_id pcdevs_ids[] = {
     { } // null terminating
 };
 
+/* Read side slots of a device lock, see struct pcd_lock */
+#define PCD_LOCK_SLOTS 16
+
+struct pcd_lock_slot
+{
+    struct rw_semaphore sem;
+} ____cacheline_aligned_in_smp;
+
+/* Device lock. A reader takes only the slot of the CPU it runs on, so
+   readers on different CPUs do not write to a shared cache line and scale
+   with the number of CPUs. A writer takes every slot in turn, the mutex
+   keeps writers from interleaving. Unlike a percpu_rw_semaphore no writer
+   waits for an RCU grace period, and writers can try the lock */
+struct pcd_lock
+{
+    struct mutex write_lock;
+    struct pcd_lock_slot slots[PCD_LOCK_SLOTS];
+};
+
+static void pcd_lock_init(struct pcd_lock *lock)
+{
+    unsigned int i;
+
+    mutex_init(&lock->write_lock);
+    for (i = 0; i < PCD_LOCK_SLOTS; i++)
+    {
+        init_rwsem(&lock->slots[i].sem);
+    }
+}
+
+/* Takes the read side, the result is the slot for pcd_up_read(). The
+   reader may move to another CPU meanwhile, it keeps the slot it took */
+static unsigned int pcd_down_read(struct pcd_lock *lock)
+{
+    unsigned int slot = raw_smp_processor_id() % PCD_LOCK_SLOTS;
+
+    down_read(&lock->slots[slot].sem);
+    return slot;
+}
+
+static bool pcd_down_read_trylock(struct pcd_lock *lock, unsigned int *slot)
+{
+    *slot = raw_smp_processor_id() % PCD_LOCK_SLOTS;
+    return down_read_trylock(&lock->slots[*slot].sem);
+}
+
+static void pcd_up_read(struct pcd_lock *lock, unsigned int slot)
+{
+    up_read(&lock->slots[slot].sem);
+}
+
+static void pcd_down_write(struct pcd_lock *lock)
+{
+    unsigned int i;
+
+    mutex_lock(&lock->write_lock);
+    for (i = 0; i < PCD_LOCK_SLOTS; i++)
+    {
+        down_write_nest_lock(&lock->slots[i].sem, &lock->write_lock);
+    }
+}
+
+/* Fails instead of waiting for a reader or another writer */
+static bool pcd_down_write_trylock(struct pcd_lock *lock)
+{
+    unsigned int i;
+
+    if (!mutex_trylock(&lock->write_lock))
+    {
+        return false;
+    }
+
+    for (i = 0; i < PCD_LOCK_SLOTS; i++)
+    {
+        if (!down_write_trylock(&lock->slots[i].sem))
+        {
+            while (i--)
+            {
+                up_write(&lock->slots[i].sem);
+            }
+            mutex_unlock(&lock->write_lock);
+            return false;
+        }
+    }
+    return true;
+}
+
+static void pcd_up_write(struct pcd_lock *lock)
+{
+    unsigned int i;
+
+    for (i = 0; i < PCD_LOCK_SLOTS; i++)
+    {
+        up_write(&lock->slots[i].sem);
+    }
+    mutex_unlock(&lock->write_lock);
+}
+
 /* Device private data structure */
 struct pcdev_private_data
 {
     struct pcdev_platform_data pdata;
     char *buffer;
+    /* Writers exclude everybody, readers never block each other */
+    struct pcd_lock lock;
     dev_t dev_num;
     struct cdev cdev;
 };
@@ -64,45 +169,195 @@ struct pcdrv_private_data
     struct device *device_pcd;
 };
 
-struct pcdrv_private_data pcdrv_data;
+static struct pcdrv_private_data pcdrv_data;
 
-loff_t pcd_lseek(struct file *filp, loff_t offset, int whence)
+static loff_t pcd_lseek(struct file *filp, loff_t offset, int whence)
 {
-    return 0;
+    struct pcdev_private_data *dev_data = filp->private_data;
+    loff_t max_size = dev_data->pdata.size;
+    loff_t tmp;
+
+    switch(whence)
+    {
+        case SEEK_SET:
+            tmp = offset;
+            break;
+        case SEEK_CUR:
+            tmp = filp->f_pos + offset;
+            break;
+        case SEEK_END:
+            tmp = max_size + offset;
+            break;
+        default:
+            return -EINVAL;
+    }
+
+    if (tmp > max_size || tmp < 0)
+    {
+        return -EINVAL;
+    }
+
+    filp->f_pos = tmp;
+    return filp->f_pos;
 }
 
-ssize_t pcd_read(struct file *filp, char __user *buff, size_t count, loff_t * f_pos)
+/* read(), readv(), preadv2() and io_uring reads all end up here. Every segment
+   of a vectored request is served within this single call */
+static ssize_t pcd_read_iter(struct kiocb *iocb, struct iov_iter *to)
 {
-    return 0;
+    struct pcdev_private_data *dev_data = iocb->ki_filp->private_data;
+    loff_t max_size = dev_data->pdata.size;
+    loff_t pos = iocb->ki_pos;
+    size_t count = iov_iter_count(to);
+    size_t copied;
+    unsigned int slot;
+
+    /* pread() does not go through lseek, so the position may be past the end */
+    if (pos >= max_size)
+    {
+        return 0;
+    }
+
+    if ((pos + count) > max_size)
+    {
+        count = max_size - pos;
+    }
+
+    /* Nowait requests (RWF_NOWAIT, inline io_uring submissions) must not
+       sleep on the lock, the caller retries them from a blocking context */
+    if (iocb->ki_flags & IOCB_NOWAIT)
+    {
+        if (!pcd_down_read_trylock(&dev_data->lock, &slot))
+        {
+            return -EAGAIN;
+        }
+    }
+    else
+    {
+        slot = pcd_down_read(&dev_data->lock);
+    }
+
+    copied = copy_to_iter(dev_data->buffer + pos, count, to);
+    pcd_up_read(&dev_data->lock, slot);
+
+    if (!copied && count)
+    {
+        return -EFAULT;
+    }
+
+    iocb->ki_pos += copied;
+    return copied;
 }
 
-ssize_t pcd_write(struct file *filp, const char __user *buff, size_t count, loff_t *f_pos)
+static ssize_t pcd_write_iter(struct kiocb *iocb, struct iov_iter *from)
 {
-    return -ENOMEM;
+    struct pcdev_private_data *dev_data = iocb->ki_filp->private_data;
+    loff_t max_size = dev_data->pdata.size;
+    loff_t pos = iocb->ki_pos;
+    size_t count = iov_iter_count(from);
+    size_t copied;
+
+    if (pos >= max_size)
+    {
+        count = 0;
+    }
+    else if ((pos + count) > max_size)
+    {
+        count = max_size - pos;
+    }
+
+    if (!count)
+    {
+        return -ENOMEM;
+    }
+
+    /* Nowait requests must not sleep on the lock, see pcd_read_iter() */
+    if (iocb->ki_flags & IOCB_NOWAIT)
+    {
+        if (!pcd_down_write_trylock(&dev_data->lock))
+        {
+            return -EAGAIN;
+        }
+    }
+    else
+    {
+        pcd_down_write(&dev_data->lock);
+    }
+
+    copied = copy_from_iter(dev_data->buffer + pos, count, from);
+    pcd_up_write(&dev_data->lock);
+
+    if (!copied)
+    {
+        return -EFAULT;
+    }
+
+    iocb->ki_pos += copied;
+    return copied;
 }
 
-int pcd_open(struct inode *inode, struct file *filp)
+static int check_permission(int dev_perm, int acc_mode)
 {
+    if (dev_perm == RDWR)
+    {
+        return 0;
+    }
+    if ( (dev_perm == RDONLY) && ( (acc_mode & FMODE_READ) && !(acc_mode & FMODE_WRITE)) )
+    {
+        return 0;
+    }
+    if ( (dev_perm == WRONLY) && ( !(acc_mode & FMODE_READ) && (acc_mode & FMODE_WRITE)) )
+    {
+        return 0;
+    }
+
+    return -EPERM;
+}
+
+static int pcd_open(struct inode *inode, struct file *filp)
+{
+    struct pcdev_private_data *dev_data = container_of(inode->i_cdev, struct pcdev_private_data, cdev);
+    int ret;
+
+    /* to supply device private data to other methods of the driver */
+    filp->private_data = dev_data;
+
+    ret = check_permission(dev_data->pdata.perm, filp->f_mode);
+    if (ret)
+    {
+        return ret;
+    }
+
+    /* Reads and writes can be served without sleeping, so io_uring and
+       RWF_NOWAIT requests are completed inline instead of in a worker thread */
+    filp->f_mode |= FMODE_NOWAIT;
+
     return 0;
 }
 
-int pcd_release(struct inode *inode, struct file *filp)
+static int pcd_release(struct inode *inode, struct file *filp)
 {
     return 0;
 }
 
 /* File operations for the driver */
-struct file_operations pcd_fops = {
+static struct file_operations pcd_fops = {
     .open = pcd_open,
-    .read = pcd_read,
-    .write = pcd_write,
+    .read_iter = pcd_read_iter,
+    .write_iter = pcd_write_iter,
     .llseek = pcd_lseek,
     .release = pcd_release,
     .owner = THIS_MODULE
 };
 
+/* devm action releasing the device buffer */
+static void pcd_buffer_free(void *buffer)
+{
+    vfree(buffer);
+}
+
 /* gets called when the device is removed from the system */
-int pcd_platform_driver_remove(struct platform_device *pdev)
+static void pcd_platform_driver_remove(struct platform_device *pdev)
 {
     struct pcdev_private_data *dev_data = dev_get_drvdata(&pdev->dev);
 
@@ -113,18 +368,26 @@ int pcd_platform_driver_remove(struct platform_device *pdev)
     cdev_del(&dev_data->cdev);
 
     /* 3. Free the memory held by the device
-          Not needed because there is devm_kzmalloc used in the probe function */
+          Not needed because there are devm_* helpers used in the probe function */
     // kfree(dev_data->buffer);
     // kfree(dev_data);
 
     pcdrv_data.total_devices--;
 
     pr_info("A device is removed\n");
+}
+
+#if LINUX_VERSION_CODE < KERNEL_VERSION(6, 11, 0)
+/* remove() returned an error code nobody looked at before 6.11 */
+static int pcd_platform_driver_remove_int(struct platform_device *pdev)
+{
+    pcd_platform_driver_remove(pdev);
     return 0;
 }
+#endif
 
 /* gets called when matched platform device is found */
-int pcd_platform_driver_probe(struct platform_device *pdev)
+static int pcd_platform_driver_probe(struct platform_device *pdev)
 {
     int ret;
     
@@ -159,21 +422,30 @@ int pcd_platform_driver_probe(struct platform_device *pdev)
     dev_data->pdata.serial_number = pdata->serial_number;
 
     pr_info("Device serial number = %s\n", dev_data->pdata.serial_number);
-    pr_info("Device size = %d\n", dev_data->pdata.size);
+    pr_info("Device size = %llu\n", dev_data->pdata.size);
     pr_info("Device permission = %d\n", dev_data->pdata.perm);
 
     pr_info("Config item 1 = %d\n", pcdev_config[pdev->id_entry->driver_data].config_item1);
     pr_info("Config item 2 = %d\n", pcdev_config[pdev->id_entry->driver_data].config_item2);
 
     /* 3. Dynamically allocate memory for the device buffer using size 
-    information from the platform data */
-    dev_data->buffer = devm_kzalloc(&pdev->dev, dev_data->pdata.size, GFP_KERNEL);
+    information from the platform data. vmalloc does not need physically
+    contiguous memory, so large buffers do not fail on a fragmented system */
+    dev_data->buffer = vzalloc(dev_data->pdata.size);
     if (!dev_data->buffer)
     {
         pr_err("Cannot allocate memory\n");
         return -ENOMEM;
     }
 
+    ret = devm_add_action_or_reset(&pdev->dev, pcd_buffer_free, dev_data->buffer);
+    if (ret)
+    {
+        return ret;
+    }
+
+    pcd_lock_init(&dev_data->lock);
+
     /* 4. Get the device number */
     dev_data->dev_num = pcdrv_data.device_num_base + pdev->id;
 
@@ -205,9 +477,13 @@ int pcd_platform_driver_probe(struct platform_device *pdev)
     return 0;
 }
 
-struct platform_driver pcd_platform_driver = {
+static struct platform_driver pcd_platform_driver = {
     .probe = pcd_platform_driver_probe,
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 11, 0)
     .remove = pcd_platform_driver_remove,
+#else
+    .remove = pcd_platform_driver_remove_int,
+#endif
     .id_table = pcdevs_ids,
     .driver = { /* this member is mandatory */
         .name = "pseudo-char-device"
@@ -227,7 +503,11 @@ static int __init pcd_platform_driver_init(void)
     }
 
     /* 2. Create device class under /sys/class */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 4, 0)
+    pcdrv_data.class_pcd = class_create("pcd_class");
+#else
     pcdrv_data.class_pcd = class_create(THIS_MODULE, "pcd_class");
+#endif
     if (IS_ERR(pcdrv_data.class_pcd))
     {
         pr_err("Class creation failed\n");
@@ -1,6 +1,8 @@
 #ifndef PLATFORM_H
 #define PLATFORM_H
 
+#include <linux/types.h>
+
 #define RDWR 0x11
 #define RDONLY 0x10
 #define WRONLY 0x01
@@ -9,7 +11,7 @@
 
 struct pcdev_platform_data
 {
-    int size;
+    u64 size;
     int perm;
     const char *serial_number;
 };
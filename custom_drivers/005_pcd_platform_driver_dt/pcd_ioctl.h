@@ -0,0 +1,194 @@
+#ifndef PCD_IOCTL_H
+#define PCD_IOCTL_H
+
+/* ioctl interface of the pcdev devices, shared by the driver and user space */
+
+#include <linux/types.h>
+#include <linux/ioctl.h>
+
+#define PCD_IOC_MAGIC 'p'
+
+/* Byte range of a device */
+struct pcd_range
+{
+    __u64 offset;
+    __u64 len;
+};
+
+/* Releases the memory backing a range, it reads back as zeros afterwards.
+   Whole pages are given back, partial pages at the edges are zeroed.
+   Fails with EBUSY while the device is mapped into user space */
+#define PCD_IOC_DISCARD _IOW(PCD_IOC_MAGIC, 1, struct pcd_range)
+
+#define PCD_IO_READ  0
+#define PCD_IO_WRITE 1
+
+/* One read or write of a batch */
+struct pcd_io_vec
+{
+    __u64 offset;   /* device offset */
+    __u64 len;      /* number of bytes */
+    __u64 buf;      /* user buffer, cast from a pointer */
+    __u32 dir;      /* PCD_IO_READ or PCD_IO_WRITE */
+    __s32 result;   /* out: bytes transferred or a negative errno */
+};
+
+#define PCD_IO_BATCH_MAX 1024
+
+struct pcd_io_batch
+{
+    __u64 vecs;     /* array of struct pcd_io_vec, cast from a pointer */
+    __u32 count;    /* number of entries, at most PCD_IO_BATCH_MAX */
+    __u32 flags;    /* must be 0 */
+};
+
+/* Executes all entries in order within a single call. A failed entry does
+   not stop the batch, its result field holds the error. Reads need the
+   device opened for reading, writes for writing. Linear mode only */
+#define PCD_IOC_BATCH _IOW(PCD_IOC_MAGIC, 2, struct pcd_io_batch)
+
+/*
+ * Submission/completion rings shared with user space.
+ *
+ * PCD_IOC_RING_SETUP returns a new file descriptor, mmap() ring_size bytes
+ * of it at offset 0. The mapping starts with the SQ and the CQ control
+ * blocks, the SQE array is at sq_off and the CQE array at cq_off.
+ *
+ * User space fills the SQE at sq tail & mask and then store-releases the
+ * incremented tail. Completions are consumed by load-acquiring cq tail,
+ * reading the CQEs from cq head on and store-releasing the new head.
+ *
+ * A kernel thread executes the submissions. Once it has found nothing to do
+ * for sq_idle_ms (PCD_RING_SQPOLL) or right away (no PCD_RING_SQPOLL) it sets
+ * PCD_RING_NEED_WAKEUP in the SQ flags and sleeps, so after publishing new
+ * entries user space checks the flag (after a full barrier) and calls
+ * PCD_RING_IOC_ENTER on the ring fd if it is set. The thread also stops
+ * taking submissions while the CQ is full.
+ */
+struct pcd_ring_ctrl
+{
+    __u32 head;
+    __u32 tail;
+    __u32 mask;
+    __u32 entries;
+    __u32 flags;
+    __u32 resv[11];
+};
+
+#define PCD_RING_NEED_WAKEUP (1U << 0)
+
+#define PCD_OP_NOP   0
+#define PCD_OP_READ  1  /* device at off -> user buffer at addr */
+#define PCD_OP_WRITE 2  /* user buffer at addr -> device at off */
+#define PCD_OP_COPY  3  /* device at addr -> device at off, ranges must not overlap */
+
+struct pcd_sqe
+{
+    __u8 opcode;
+    __u8 resv[3];
+    __u32 len;
+    __u64 off;
+    __u64 addr;
+    __u64 user_data;    /* copied to the completion */
+};
+
+struct pcd_cqe
+{
+    __u64 user_data;
+    __s32 res;          /* bytes transferred or a negative errno */
+    __u32 flags;
+};
+
+#define PCD_RING_SQPOLL (1U << 0)
+#define PCD_RING_MAX_ENTRIES 4096
+#define PCD_RING_MAX_IDLE_MS 10000
+
+struct pcd_ring_params
+{
+    __u32 sq_entries;   /* rounded up to a power of two */
+    __u32 cq_entries;   /* 0 means twice sq_entries */
+    __u32 flags;        /* PCD_RING_SQPOLL */
+    __u32 sq_idle_ms;   /* SQPOLL only, 0 means 1000, at most PCD_RING_MAX_IDLE_MS */
+    __u64 sq_off;       /* out */
+    __u64 cq_off;       /* out */
+    __u64 ring_size;    /* out */
+};
+
+/* Linear mode only. Reads and writes through the ring need the same access
+   mode of the device file as read() and write(), copies need both. A device
+   takes up to 16 rings (EMFILE), PCD_RING_SQPOLL needs CAP_SYS_NICE (EPERM) */
+#define PCD_IOC_RING_SETUP _IOWR(PCD_IOC_MAGIC, 3, struct pcd_ring_params)
+
+/* Issued on the ring fd. Wakes up the kernel thread and waits until at
+   least arg completions are available, returns their number */
+#define PCD_RING_IOC_ENTER _IO(PCD_IOC_MAGIC, 4)
+
+/* Source of a copy between two devices */
+struct pcd_copy
+{
+    __s64 src_fd;       /* a pcdev opened for reading */
+    __u64 src_offset;
+    __u64 len;
+    __u64 dst_offset;
+};
+
+/* copy_file_range() for devices: copies len bytes from the device src_fd
+   refers to into the device the ioctl is issued on, which has to be open
+   for writing. Both ranges must lie within their devices and must not
+   overlap when both are the same device. Returns the number of bytes copied */
+#define PCD_IOC_COPY_RANGE _IOW(PCD_IOC_MAGIC, 5, struct pcd_copy)
+
+/* Grows or shrinks the device to the given number of bytes while it stays
+   in use. Contents up to the smaller of both sizes are preserved, grown
+   space reads as zeros. Shrinking fails with EBUSY while the device is
+   mapped into user space. Linear mode only, persistent devices (reserved
+   memory or backing file) keep their size. The size is also writable in
+   /sys/class/pcd_class/pcdev-N/size */
+#define PCD_IOC_RESIZE _IOW(PCD_IOC_MAGIC, 6, __u64)
+
+/* Takes a point-in-time snapshot of the device and returns a read-only
+   file descriptor for it. read(), pread() and mmap() of the descriptor see
+   the contents of the device at the time of the ioctl, whatever is written
+   afterwards. Taking it copies nothing, the first write to a page after it
+   copies that page. Fails with EBUSY while the device is mapped into user
+   space, the device can be mapped again afterwards. The snapshot lives
+   until its descriptor is closed. Linear mode only */
+#define PCD_IOC_SNAPSHOT _IO(PCD_IOC_MAGIC, 7)
+
+struct pcd_verify
+{
+    __u64 offset;
+    __u64 len;
+    __u64 pages;        /* out: pages checked, holes are not */
+    __u64 errors;       /* out: pages that do not match their checksum */
+    __u64 first_error;  /* out: offset of the first of them */
+};
+
+/* Checks the pages of a range against their checksums and reports the
+   damaged ones. Reads of a damaged page fail with EIO, a scrubber checks
+   all pages in the background as well. Pages in a shared writable mapping
+   are skipped. Needs the device opened for reading and checksums enabled
+   (DT: org,checksum, configfs: checksum), EOPNOTSUPP otherwise */
+#define PCD_IOC_VERIFY _IOWR(PCD_IOC_MAGIC, 8, struct pcd_verify)
+
+/*
+ * io_uring passthrough commands (IORING_OP_URING_CMD), cmd_op selects the
+ * command and struct pcd_uring_cmd is its payload in the SQE cmd area, so
+ * the ring has to be set up with IORING_SETUP_SQE128. The CQE res is the
+ * number of bytes processed or a negative errno.
+ */
+struct pcd_uring_cmd
+{
+    __u64 off;      /* device offset */
+    __u64 len;      /* number of bytes */
+    __u64 addr;     /* user buffer or source device offset, see below */
+    __u32 value;    /* fill byte */
+    __u32 flags;    /* must be 0 */
+};
+
+#define PCD_URING_CMD_COPY     1  /* device at addr -> device at off, no overlap */
+#define PCD_URING_CMD_FILL     2  /* fills off..off+len with the low byte of value */
+#define PCD_URING_CMD_CHECKSUM 3  /* CRC32C of off..off+len stored as __u32 at addr */
+#define PCD_URING_CMD_SNAPSHOT 4  /* consistent copy of off..off+len to the buffer at addr */
+
+#endif // PCD_IOCTL_H
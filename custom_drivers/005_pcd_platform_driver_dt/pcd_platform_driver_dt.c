@@ -10,13 +10,58 @@
 #include <linux/mod_devicetable.h>
 #include <linux/of.h>
 #include <linux/of_device.h>
+#include <linux/mm.h>
+#include <linux/highmem.h>
+#include <linux/io.h>
+#include <linux/xarray.h>
+#include <linux/rwsem.h>
+#include <linux/uio.h>
+#include <linux/mutex.h>
+#include <linux/wait.h>
+#include <linux/poll.h>
+#include <linux/compat.h>
+#include <linux/percpu.h>
+#include <linux/u64_stats_sync.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+#include <linux/ktime.h>
+#include <linux/log2.h>
+#include <linux/kref.h>
+#include <linux/configfs.h>
+#include <linux/kthread.h>
+#include <linux/sched/mm.h>
+#include <linux/anon_inodes.h>
+#include <linux/capability.h>
+#include <linux/vmalloc.h>
+#include <linux/file.h>
+#include <linux/version.h>
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 14, 0)
+#include <linux/crc32.h>
+#else
+#include <linux/crc32c.h>
+#endif
+#include <linux/blkdev.h>
+#include <linux/blk-mq.h>
+#include <linux/of_reserved_mem.h>
+#include <linux/workqueue.h>
+#include <linux/lz4.h>
+#include <linux/lzo.h>
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 7, 0)
+#include <linux/io_uring/cmd.h>
+#elif LINUX_VERSION_CODE >= KERNEL_VERSION(5, 19, 0)
+#include <linux/io_uring.h>
+#endif
 #include "platform.h"
+#include "pcd_ioctl.h"
 
 #ifdef pr_fmt
 #undef pr_fmt
 #endif
 #define pr_fmt(fmt) "%s : " fmt,  __func__
 
+/* The driver reserves a whole major, devices are not limited by a fixed table */
+#define PCD_MAX_DEVICES (1U << MINORBITS)
+
 
 struct device_config
 {
@@ -32,7 +77,7 @@ enum pcdev_names
     PCDEVDX1
 };
 
-struct device_config pcdev_config[] = {
+static struct device_config pcdev_config[] = {
     [PCDEVAX1] = { .config_item1 = 60, .config_item2 = 21 },
     [PCDEVBX1] = { .config_item1 = 50, .config_item2 = 22 },
     [PCDEVCX1] = { .config_item1 = 40, .config_item2 = 23 },
@@ -40,7 +85,7 @@ struct device_config pcdev_config[] = {
 };
 
 /* the below table should be null terminated */
-struct platform_device_id pcdevs_ids[] = {
+static struct platform_device_id pcdevs_ids[] = {
     { .name = "pcdev-A1x", .driver_data = PCDEVAX1 },
     { .name = "pcdev-B1x", .driver_data = PCDEVBX1 },
     { .name = "pcdev-C1x", .driver_data = PCDEVCX1 },
@@ -48,7 +93,7 @@ struct platform_device_id pcdevs_ids[] = {
     { } // null terminating
 };
 
-struct of_device_id org_pcdev_dt_match[] = {
+static struct of_device_id org_pcdev_dt_match[] = {
     { .compatible = "pcdev-A1x", .data = (void*) PCDEVAX1 },
     { .compatible = "pcdev-B1x", .data = (void*) PCDEVBX1 },
     { .compatible = "pcdev-C1x", .data = (void*) PCDEVCX1 },
@@ -56,87 +101,4739 @@ struct of_device_id org_pcdev_dt_match[] = {
     { } // null terminating
 };
 
+/* Usage counters of a device. Every CPU updates its own copy, the copies
+   are summed up only when somebody reads the statistics */
+struct pcd_stats
+{
+    u64 bytes_read;
+    u64 bytes_written;
+    u64 reads;
+    u64 writes;
+    u64 opens;
+    u64 releases;
+    u64 efault;
+    u64 enomem;
+    struct u64_stats_sync syncp;
+};
+
+/* Operations with a latency histogram */
+enum pcd_lat_op
+{
+    PCD_LAT_OPEN,
+    PCD_LAT_READ,
+    PCD_LAT_WRITE,
+    PCD_LAT_LSEEK,
+    PCD_LAT_NR_OPS
+};
+
+/* Bucket n counts the operations that took [2^(n-1), 2^n) ns, the last
+   bucket also takes everything slower */
+#define PCD_LAT_BUCKETS 40
+
+/* Latency histograms of a device, one copy per CPU like the statistics */
+struct pcd_latency
+{
+    unsigned long buckets[PCD_LAT_NR_OPS][PCD_LAT_BUCKETS];
+};
+
+/* Read side slots of a device lock, see struct pcd_lock */
+#define PCD_LOCK_SLOTS 16
+
+struct pcd_lock_slot
+{
+    struct rw_semaphore sem;
+} ____cacheline_aligned_in_smp;
+
+/* Device lock. A reader takes only the slot of the CPU it runs on, so
+   readers on different CPUs do not write to a shared cache line and scale
+   with the number of CPUs. A writer takes every slot in turn, the mutex
+   keeps writers from interleaving. Unlike a percpu_rw_semaphore no writer
+   waits for an RCU grace period, and writers can try the lock */
+struct pcd_lock
+{
+    struct mutex write_lock;
+    struct pcd_lock_slot slots[PCD_LOCK_SLOTS];
+};
+
+static void pcd_lock_init(struct pcd_lock *lock)
+{
+    unsigned int i;
+
+    mutex_init(&lock->write_lock);
+    for (i = 0; i < PCD_LOCK_SLOTS; i++)
+    {
+        init_rwsem(&lock->slots[i].sem);
+    }
+}
+
+/* Takes the read side, the result is the slot for pcd_up_read(). The
+   reader may move to another CPU meanwhile, it keeps the slot it took */
+static unsigned int pcd_down_read(struct pcd_lock *lock)
+{
+    unsigned int slot = raw_smp_processor_id() % PCD_LOCK_SLOTS;
+
+    down_read(&lock->slots[slot].sem);
+    return slot;
+}
+
+static bool pcd_down_read_trylock(struct pcd_lock *lock, unsigned int *slot)
+{
+    *slot = raw_smp_processor_id() % PCD_LOCK_SLOTS;
+    return down_read_trylock(&lock->slots[*slot].sem);
+}
+
+static void pcd_up_read(struct pcd_lock *lock, unsigned int slot)
+{
+    up_read(&lock->slots[slot].sem);
+}
+
+static void pcd_down_write(struct pcd_lock *lock)
+{
+    unsigned int i;
+
+    mutex_lock(&lock->write_lock);
+    for (i = 0; i < PCD_LOCK_SLOTS; i++)
+    {
+        down_write_nest_lock(&lock->slots[i].sem, &lock->write_lock);
+    }
+}
+
+/* Fails instead of waiting for a reader or another writer */
+static bool pcd_down_write_trylock(struct pcd_lock *lock)
+{
+    unsigned int i;
+
+    if (!mutex_trylock(&lock->write_lock))
+    {
+        return false;
+    }
+
+    for (i = 0; i < PCD_LOCK_SLOTS; i++)
+    {
+        if (!down_write_trylock(&lock->slots[i].sem))
+        {
+            while (i--)
+            {
+                up_write(&lock->slots[i].sem);
+            }
+            mutex_unlock(&lock->write_lock);
+            return false;
+        }
+    }
+    return true;
+}
+
+static void pcd_up_write(struct pcd_lock *lock)
+{
+    unsigned int i;
+
+    for (i = 0; i < PCD_LOCK_SLOTS; i++)
+    {
+        up_write(&lock->slots[i].sem);
+    }
+    mutex_unlock(&lock->write_lock);
+}
+
 /* Device private data structure */
 struct pcdev_private_data
 {
+    /* Held by the device until it is removed and by every open file of it.
+       Mappings, snapshots and rings keep the file they were created from
+       open and the block device drops its reference once the disk is freed,
+       so the data lives as long as any of them, see pcd_dev_release() */
+    struct kref ref;
     struct pcdev_platform_data pdata;
-    char *buffer;
+    /* Device storage. It is a sparse array of individual pages, each page
+       gets allocated on first write, so probing is cheap whatever the size.
+       Missing pages are holes and read back as zeros */
+    struct xarray pages;
+    atomic_long_t nr_pages; /* resident pages */
+    atomic_t nr_mmaps; /* live user space mappings of the storage */
+    atomic_t nr_rings; /* rings set up on the device, see pcd_ring_setup() */
+    /* Serializes writers of the device against each other and against
+       readers, readers do not block each other. Accesses through mmap()
+       are not covered by the lock */
+    struct pcd_lock lock;
+    /* FIFO mode: fifo_used bytes of data start at fifo_tail, writers append
+       at fifo_head. Both wrap around at the end of the buffer */
+    struct mutex fifo_lock;
+    wait_queue_head_t fifo_readq;
+    wait_queue_head_t fifo_writeq;
+    unsigned long fifo_head;
+    unsigned long fifo_tail;
+    unsigned long fifo_used;
+    bool counters_ready; /* stats and latency are allocated on first open */
+    struct pcd_stats __percpu *stats;
+    struct pcd_latency __percpu *latency;
+    struct dentry *debugfs_dir;
+    /* Persistence, see pcd_persist_attach(). The pages of a reserved memory
+       region survive module reloads and warm reboots by themselves, pages
+       of a device with a backing file are written back to it, tracked by
+       the PCD_PAGE_* marks */
+    bool persist_mem;
+    void *mem; /* the memremap()ed region, see pcd_persist_mem_attach() */
+    struct file *backing;
+    struct delayed_work writeback_work;
+    /* Point-in-time snapshots, see pcd_snapshot_create(). Writers hand the
+       old contents of a page to every snapshot that still needs it before
+       they change the page, see pcd_snap_preserve() */
+    struct list_head snapshots; /* RCU list, changed under cow_lock */
+    struct mutex cow_lock;
+    atomic_long_t nr_snap_pages; /* pages held by snapshots */
+    /* compression of cold pages, NULL unless enabled, see pcd_zstore_attach() */
+    struct pcd_zstore *zstore;
+    /* per-page checksums, NULL unless enabled, see pcd_csum_attach() */
+    struct pcd_csum *csum;
+    /* block device front end, NULL unless the blkdev parameter is set */
+    struct gendisk *disk;
+    struct blk_mq_tag_set tag_set;
     dev_t dev_num;
-    struct cdev cdev;
+    /* not embedded, open files keep it after the device data is gone */
+    struct cdev *cdev;
 };
 
 /* Driver private data structure */
 struct pcdrv_private_data
 {
-    int total_devices;
     dev_t device_num_base;
     struct class *class_pcd;
-    struct device *device_pcd;
+    struct dentry *debugfs_root;
+    /* probe timing, devices are probed in parallel */
+    spinlock_t probe_lock;
+    unsigned int probed;
+    u64 probe_first_ns;
+    u64 probe_last_ns;
+    u64 probe_total_ns;
+    u64 probe_max_ns;
 };
 
-struct pcdrv_private_data pcdrv_data;
+static struct pcdrv_private_data pcdrv_data;
+
+/* Devices by minor, see pcd_dev_get(). A freed minor (and with it the
+   pcdev-N name) is given to the next probed device */
+static DEFINE_XARRAY_ALLOC(pcd_minors);
+
+static DEFINE_MUTEX(pcd_counters_lock);
 
-loff_t pcd_lseek(struct file *filp, loff_t offset, int whence)
+/* Linear devices are also exposed as /dev/pcdblkN when set */
+static bool blkdev;
+module_param(blkdev, bool, 0444);
+MODULE_PARM_DESC(blkdev, "Expose linear devices as /dev/pcdblkN block devices too");
+
+/* Requests in flight per hardware queue of a block device */
+#define PCD_BLK_QUEUE_DEPTH 128
+
+/* Dirty pages of devices with a backing file are written back this often */
+static unsigned int writeback_ms = 1000;
+module_param(writeback_ms, uint, 0644);
+MODULE_PARM_DESC(writeback_ms, "Write-back interval of devices with a backing file, in ms");
+
+/* A snapshot of a device, the file behind a PCD_IOC_SNAPSHOT descriptor.
+   Pages the device still shares with the snapshot are missing from its
+   array, preserved pages are kept there, holes as PCD_SNAP_HOLE */
+struct pcd_snapshot
 {
-    return 0;
-}
+    struct list_head node;
+    struct pcdev_private_data *dev_data;
+    struct file *file;  /* the device file the snapshot was taken on */
+    u64 size;
+    pgoff_t last;       /* last page index */
+    struct xarray pages;
+};
+
+#define PCD_SNAP_HOLE xa_mk_value(0)
 
-ssize_t pcd_read(struct file *filp, char __user *buff, size_t count, loff_t * f_pos)
+/* Storage page marks of devices with a backing file, PCD_PAGE_MAPPED also
+   of devices with checksums */
+#define PCD_PAGE_DIRTY XA_MARK_0    /* modified since it was last written back */
+#define PCD_PAGE_MAPPED XA_MARK_1   /* in a shared writable mapping, see pcd_vm_fault() */
+
+/* Storage page mark of compressed devices, accessed since the last scan */
+#define PCD_PAGE_HOT XA_MARK_2
+
+/* A fast compressor for cold pages. compress() returns the compressed size
+   of a page, 0 when it does not fit into @dst_len bytes */
+struct pcd_compressor
 {
-    return 0;
+    const char *name;
+    size_t wrkmem_size;
+    size_t (*compress)(const void *src, void *dst, size_t dst_len, void *wrkmem);
+    int (*decompress)(const void *src, size_t len, void *dst);
+};
+
+/* A compressed page. It takes the place of the page in the page array as a
+   pointer tagged with PCD_ZPAGE_TAG */
+struct pcd_zpage
+{
+    unsigned int len;
+    u8 data[];
+};
+
+#define PCD_ZPAGE_TAG 1
+/* pages that do not compress below this stay as they are */
+#define PCD_ZPAGE_MAX (PAGE_SIZE * 3 / 4)
+
+/* Compressed storage of a device, see pcd_zstore_attach() */
+struct pcd_zstore
+{
+    struct pcdev_private_data *dev_data;
+    const struct pcd_compressor *comp;
+    void *wrkmem;               /* only used by the scan */
+    void *buf;                  /* compress() output, worst case size */
+    struct delayed_work work;
+    struct mutex lock;          /* serializes decompressions */
+    atomic_long_t nr_zpages;
+    atomic_long_t compr_bytes;  /* sum of the compressed sizes */
+    atomic_long_t mem_bytes;    /* memory taken by the compressed pages */
+    atomic64_t zero_pages;      /* released because they only held zeros */
+    atomic64_t incompressible;
+    atomic64_t compressions;
+    atomic64_t compress_ns;
+    atomic64_t decompressions;
+    atomic64_t decompress_ns;
+};
+
+/* Pages of compressed devices untouched for one to two scans get compressed */
+static unsigned int compress_ms = 10000;
+module_param(compress_ms, uint, 0644);
+MODULE_PARM_DESC(compress_ms, "Cold page scan interval of compressed devices, in ms");
+
+/* Writers of a page hold one of these from the change until its checksum is
+   updated, the page index picks it */
+#define PCD_CSUM_LOCKS 64
+
+/* Checksums are kept in page sized chunks, see pcd_csum_slot() */
+#define PCD_CSUM_PER_CHUNK (PAGE_SIZE / sizeof(u32))
+
+/* Per-page checksums of a device, see pcd_csum_attach(). The CRC32Cs are
+   kept apart from the pages, pages of a reserved memory region have no
+   struct page to keep them in */
+struct pcd_csum
+{
+    struct pcdev_private_data *dev_data;
+    struct delayed_work work;   /* the scrubber */
+    struct mutex locks[PCD_CSUM_LOCKS];
+    struct xarray crcs;         /* chunks by index / PCD_CSUM_PER_CHUNK */
+    u32 zero_crc;               /* of a page of zeros */
+    atomic64_t errors;
+    atomic64_t last_error;      /* offset of the page that failed last */
+    atomic64_t scrubs;          /* complete passes */
+    atomic64_t scrubbed_pages;
+    atomic64_t scrub_ns;
+};
+
+/* Every page of a device with checksums is checked this often */
+static unsigned int scrub_ms = 60000;
+module_param(scrub_ms, uint, 0644);
+MODULE_PARM_DESC(scrub_ms, "Scrub interval of devices with checksums, in ms");
+
+static struct file_operations pcd_fops;
+
+static size_t pcd_lz4_compress(const void *src, void *dst, size_t dst_len, void *wrkmem)
+{
+    return LZ4_compress_default(src, dst, PAGE_SIZE, dst_len, wrkmem);
 }
 
-ssize_t pcd_write(struct file *filp, const char __user *buff, size_t count, loff_t *f_pos)
+static int pcd_lz4_decompress(const void *src, size_t len, void *dst)
 {
-    return -ENOMEM;
+    return LZ4_decompress_safe(src, dst, len, PAGE_SIZE) == PAGE_SIZE ? 0 : -EIO;
 }
 
-int pcd_open(struct inode *inode, struct file *filp)
+static size_t pcd_lzo_compress(const void *src, void *dst, size_t dst_len, void *wrkmem)
 {
-    return 0;
+    size_t len;
+
+    /* the output buffer has room for the worst case */
+    if (lzo1x_1_compress(src, PAGE_SIZE, dst, &len, wrkmem) != LZO_E_OK || len > dst_len)
+    {
+        return 0;
+    }
+    return len;
 }
 
-int pcd_release(struct inode *inode, struct file *filp)
+static int pcd_lzo_decompress(const void *src, size_t len, void *dst)
 {
+    size_t out = PAGE_SIZE;
+
+    if (lzo1x_decompress_safe(src, len, dst, &out) != LZO_E_OK || out != PAGE_SIZE)
+    {
+        return -EIO;
+    }
     return 0;
 }
 
-/* File operations for the driver */
-struct file_operations pcd_fops = {
-    .open = pcd_open,
-    .read = pcd_read,
-    .write = pcd_write,
-    .llseek = pcd_lseek,
-    .release = pcd_release,
-    .owner = THIS_MODULE
+static const struct pcd_compressor pcd_compressors[] = {
+    { "lz4", LZ4_MEM_COMPRESS, pcd_lz4_compress, pcd_lz4_decompress },
+    { "lzo", LZO1X_1_MEM_COMPRESS, pcd_lzo_compress, pcd_lzo_decompress },
 };
 
-/* gets called when the device is removed from the system */
-int pcd_platform_driver_remove(struct platform_device *pdev)
+/* Maps a page returned by pcd_storage_get() or pcd_storage_page() into the
+   kernel. Pages of a reserved memory region have no struct page, their
+   entries are their addresses in the region, which is mapped as a whole */
+static void *pcd_storage_map(struct pcdev_private_data *dev_data, void *page)
 {
-    struct pcdev_private_data *dev_data = dev_get_drvdata(&pdev->dev);
+    return dev_data->persist_mem ? page : kmap_local_page(page);
+}
 
-    /* 1. Remove a device that was created with device_create() */
-    device_destroy(pcdrv_data.class_pcd, dev_data->dev_num);
+static void pcd_storage_unmap(struct pcdev_private_data *dev_data, void *addr)
+{
+    if (!dev_data->persist_mem)
+    {
+        kunmap_local(addr);
+    }
+}
+
+/* CRC32C of a whole page. crc32c() runs on the fastest implementation the
+   kernel has, the CRC32 instructions of SSE4.2 or ARMv8 where available */
+static u32 pcd_csum_page(const void *addr)
+{
+    return ~crc32c(~0U, addr, PAGE_SIZE);
+}
+
+/* Returns where the checksum of the page at @index is kept, NULL if its
+   chunk does not exist. With @alloc the chunk is allocated if needed, its
+   slots start out with the checksum of a hole */
+static u32 *pcd_csum_slot(struct pcd_csum *cs, pgoff_t index, bool alloc)
+{
+    unsigned long chunk_index = index / PCD_CSUM_PER_CHUNK;
+    u32 *chunk = xa_load(&cs->crcs, chunk_index);
+    u32 *old;
+
+    if (!chunk && alloc)
+    {
+        chunk = kmalloc(PAGE_SIZE, GFP_KERNEL);
+        if (!chunk)
+        {
+            return NULL;
+        }
+        memset32(chunk, cs->zero_crc, PCD_CSUM_PER_CHUNK);
+
+        /* somebody else may have added it in the meantime */
+        old = xa_cmpxchg(&cs->crcs, chunk_index, NULL, chunk, GFP_KERNEL);
+        if (old)
+        {
+            kfree(chunk);
+            chunk = xa_is_err(old) ? NULL : old;
+        }
+    }
+
+    return chunk ? chunk + index % PCD_CSUM_PER_CHUNK : NULL;
+}
+
+/* Serializes a change of the page at @index with the update of its
+   checksum. Needed because block writes only hold the read side of the
+   device lock, see pcd_blk_rw() */
+static void pcd_csum_lock(struct pcdev_private_data *dev_data, pgoff_t index)
+{
+    if (dev_data->csum)
+    {
+        mutex_lock(&dev_data->csum->locks[index % PCD_CSUM_LOCKS]);
+    }
+}
+
+static void pcd_csum_unlock(struct pcdev_private_data *dev_data, pgoff_t index)
+{
+    if (dev_data->csum)
+    {
+        mutex_unlock(&dev_data->csum->locks[index % PCD_CSUM_LOCKS]);
+    }
+}
+
+/* Records the checksum of the changed page at @index, under pcd_csum_lock().
+   Sub-page writes pay for the whole page. Present pages always have their
+   slot, see pcd_storage_page() */
+static void pcd_csum_update(struct pcdev_private_data *dev_data, pgoff_t index, void *page)
+{
+    u32 *slot;
+    void *addr;
+
+    if (!dev_data->csum)
+    {
+        return;
+    }
+
+    slot = pcd_csum_slot(dev_data->csum, index, false);
+    addr = pcd_storage_map(dev_data, page);
+    WRITE_ONCE(*slot, pcd_csum_page(addr));
+    pcd_storage_unmap(dev_data, addr);
+}
+
+/* The page at @index was released, the hole it leaves reads as zeros */
+static void pcd_csum_clear(struct pcdev_private_data *dev_data, pgoff_t index)
+{
+    u32 *slot;
+
+    if (!dev_data->csum)
+    {
+        return;
+    }
+
+    slot = pcd_csum_slot(dev_data->csum, index, false);
+    if (slot)
+    {
+        WRITE_ONCE(*slot, dev_data->csum->zero_crc);
+    }
+}
+
+/* Checks the page at @index against its checksum. Pages in a shared
+   writable mapping change behind the driver's back, they are not checked
+   until the device is unmapped, see pcd_storage_unmapped() */
+static int pcd_csum_verify(struct pcdev_private_data *dev_data, pgoff_t index, void *page)
+{
+    struct pcd_csum *cs = dev_data->csum;
+    u32 *slot;
+    void *addr;
+    bool ok;
+
+    if (!cs || xa_get_mark(&dev_data->pages, index, PCD_PAGE_MAPPED))
+    {
+        return 0;
+    }
+
+    slot = pcd_csum_slot(cs, index, false);
+    addr = pcd_storage_map(dev_data, page);
+    ok = pcd_csum_page(addr) == READ_ONCE(*slot);
+
+    /* a block write may be in the middle of changing the page, it is done
+       once its lock is free */
+    if (!ok)
+    {
+        pcd_csum_lock(dev_data, index);
+        ok = pcd_csum_page(addr) == READ_ONCE(*slot);
+        pcd_csum_unlock(dev_data, index);
+    }
+    pcd_storage_unmap(dev_data, addr);
+    if (ok)
+    {
+        return 0;
+    }
+
+    atomic64_inc(&cs->errors);
+    atomic64_set(&cs->last_error, (u64)index << PAGE_SHIFT);
+    pr_err_ratelimited("Checksum mismatch in %s at offset %llu\n", dev_data->pdata.serial_number,
+                       (u64)index << PAGE_SHIFT);
+    return -EIO;
+}
+
+/* Records an access for the cold page scan of a compressed device */
+static void pcd_storage_touch(struct pcdev_private_data *dev_data, pgoff_t index)
+{
+    if (dev_data->zstore && !xa_get_mark(&dev_data->pages, index, PCD_PAGE_HOT))
+    {
+        xa_set_mark(&dev_data->pages, index, PCD_PAGE_HOT);
+    }
+}
+
+/* Puts the compressed page at @index back into a page of its own */
+static struct page *pcd_storage_unzip(struct pcdev_private_data *dev_data, pgoff_t index)
+{
+    struct pcd_zstore *zs = dev_data->zstore;
+    struct pcd_zpage *zp;
+    struct page *page;
+    void *entry;
+    void *addr;
+    u64 start;
+    int ret;
+
+    /* readers share the device lock, the first one decompresses the page
+       and frees the compressed copy, the others get the page */
+    mutex_lock(&zs->lock);
+    entry = xa_load(&dev_data->pages, index);
+    if (xa_pointer_tag(entry) != PCD_ZPAGE_TAG)
+    {
+        mutex_unlock(&zs->lock);
+        return entry;
+    }
+    zp = xa_untag_pointer(entry);
+
+    page = alloc_page(GFP_HIGHUSER);
+    if (!page)
+    {
+        mutex_unlock(&zs->lock);
+        return ERR_PTR(-ENOMEM);
+    }
+
+    start = ktime_get_ns();
+    addr = kmap_local_page(page);
+    ret = zs->comp->decompress(zp->data, zp->len, addr);
+    kunmap_local(addr);
+    atomic64_add(ktime_get_ns() - start, &zs->decompress_ns);
+    atomic64_inc(&zs->decompressions);
+
+    /* the slot exists, replacing its entry does not allocate. The
+       checksum stays where it is, readers check the decompressed data */
+    if (!ret)
+    {
+        ret = xa_err(xa_store(&dev_data->pages, index, page, GFP_KERNEL));
+    }
+    if (ret)
+    {
+        mutex_unlock(&zs->lock);
+        __free_page(page);
+        return ERR_PTR(ret);
+    }
+
+    pcd_storage_touch(dev_data, index);
+    atomic_long_inc(&dev_data->nr_pages);
+    atomic_long_dec(&zs->nr_zpages);
+    atomic_long_sub(zp->len, &zs->compr_bytes);
+    atomic_long_sub(ksize(zp), &zs->mem_bytes);
+    mutex_unlock(&zs->lock);
+
+    kfree(zp);
+    return page;
+}
+
+/* Returns the page at @index, NULL for a hole. A compressed page is
+   decompressed first, that may fail. The page is a struct page, or an
+   address on reserved memory, see pcd_storage_map() */
+static void *pcd_storage_get(struct pcdev_private_data *dev_data, pgoff_t index)
+{
+    void *entry = xa_load(&dev_data->pages, index);
+
+    if (!dev_data->zstore || !entry)
+    {
+        return entry;
+    }
+
+    if (xa_pointer_tag(entry) == PCD_ZPAGE_TAG)
+    {
+        return pcd_storage_unzip(dev_data, index);
+    }
+
+    pcd_storage_touch(dev_data, index);
+    return entry;
+}
+
+/* Releases a storage entry, a page or a compressed page */
+static void pcd_storage_release(struct pcdev_private_data *dev_data, void *entry)
+{
+    struct pcd_zstore *zs = dev_data->zstore;
+    struct pcd_zpage *zp;
+
+    if (xa_pointer_tag(entry) != PCD_ZPAGE_TAG)
+    {
+        put_page(entry);
+        atomic_long_dec(&dev_data->nr_pages);
+        return;
+    }
+
+    zp = xa_untag_pointer(entry);
+    atomic_long_dec(&zs->nr_zpages);
+    atomic_long_sub(zp->len, &zs->compr_bytes);
+    atomic_long_sub(ksize(zp), &zs->mem_bytes);
+    kfree(zp);
+}
+
+/* Returns the page backing @index, allocating it on first touch */
+static void *pcd_storage_page(struct pcdev_private_data *dev_data, pgoff_t index)
+{
+    struct page *page;
+    void *old;
+
+    old = pcd_storage_get(dev_data, index);
+    if (old)
+    {
+        return IS_ERR(old) ? NULL : old;
+    }
+
+    /* the slot holds the checksum of a hole, which matches the new page */
+    if (dev_data->csum && !pcd_csum_slot(dev_data->csum, index, true))
+    {
+        return NULL;
+    }
+
+    page = alloc_page(GFP_HIGHUSER | __GFP_ZERO);
+    if (!page)
+    {
+        return NULL;
+    }
+
+    /* somebody else may have populated the slot in the meantime */
+    old = xa_cmpxchg(&dev_data->pages, index, NULL, page, GFP_KERNEL);
+    if (old)
+    {
+        __free_page(page);
+        return xa_is_err(old) ? NULL : old;
+    }
+
+    pcd_storage_touch(dev_data, index);
+    atomic_long_inc(&dev_data->nr_pages);
+    return page;
+}
+
+/* Records a modification of the page at @index for the write-back. The
+   writer has finished changing the page, the barrier orders that before
+   the mark test and pairs with the one in pcd_persist_writeback() */
+static void pcd_storage_dirty(struct pcdev_private_data *dev_data, pgoff_t index)
+{
+    if (!dev_data->backing)
+    {
+        return;
+    }
+
+    smp_mb();
+    if (!xa_get_mark(&dev_data->pages, index, PCD_PAGE_DIRTY))
+    {
+        xa_set_mark(&dev_data->pages, index, PCD_PAGE_DIRTY);
+    }
+}
+
+/* Takes a page of a shared writable mapping back under checksum once the
+   device is not mapped anymore, the caller holds the device lock. A mapping
+   that is created meanwhile increments nr_mmaps before it can fault */
+static void pcd_storage_unmapped(struct pcdev_private_data *dev_data, pgoff_t index, void *page)
+{
+    if (atomic_read(&dev_data->nr_mmaps))
+    {
+        return;
+    }
+
+    pcd_csum_lock(dev_data, index);
+    pcd_csum_update(dev_data, index, page);
+    xa_clear_mark(&dev_data->pages, index, PCD_PAGE_MAPPED);
+    smp_mb();
+    if (atomic_read(&dev_data->nr_mmaps))
+    {
+        xa_set_mark(&dev_data->pages, index, PCD_PAGE_MAPPED);
+    }
+    pcd_csum_unlock(dev_data, index);
+}
+
+/* Hands the current contents of the page at @index to every snapshot that
+   does not have its own copy yet. Has to be called before the page is
+   changed. Called under the device lock, or from the fault of a shared
+   writable mapping, which cannot exist while a snapshot is taken */
+static int pcd_snap_preserve(struct pcdev_private_data *dev_data, pgoff_t index)
+{
+    struct pcd_snapshot *snap;
+    struct page *copy = NULL;
+    bool missing = false;
+    void *page;
+    void *addr;
+    int ret = 0;
+
+    if (list_empty(&dev_data->snapshots))
+    {
+        return 0;
+    }
+
+    /* only the first write to a page after a snapshot has to do anything */
+    rcu_read_lock();
+    list_for_each_entry_rcu(snap, &dev_data->snapshots, node)
+    {
+        if (index <= snap->last && !xa_load(&snap->pages, index))
+        {
+            missing = true;
+            break;
+        }
+    }
+    rcu_read_unlock();
+
+    if (!missing)
+    {
+        return 0;
+    }
+
+    mutex_lock(&dev_data->cow_lock);
+    page = pcd_storage_get(dev_data, index);
+    if (IS_ERR(page))
+    {
+        mutex_unlock(&dev_data->cow_lock);
+        return PTR_ERR(page);
+    }
+
+    list_for_each_entry(snap, &dev_data->snapshots, node)
+    {
+        void *entry;
+
+        if (index > snap->last || xa_load(&snap->pages, index))
+        {
+            continue;
+        }
+
+        /* one copy is shared by all snapshots, it never changes */
+        if (page && !copy)
+        {
+            copy = alloc_page(GFP_HIGHUSER);
+            if (!copy)
+            {
+                ret = -ENOMEM;
+                break;
+            }
+            addr = pcd_storage_map(dev_data, page);
+            memcpy_to_page(copy, 0, addr, PAGE_SIZE);
+            pcd_storage_unmap(dev_data, addr);
+        }
+
+        entry = page ? copy : PCD_SNAP_HOLE;
+        ret = xa_err(xa_store(&snap->pages, index, entry, GFP_KERNEL));
+        if (ret)
+        {
+            break;
+        }
+        if (page)
+        {
+            get_page(copy);
+            atomic_long_inc(&dev_data->nr_snap_pages);
+        }
+    }
+    mutex_unlock(&dev_data->cow_lock);
+
+    if (copy)
+    {
+        put_page(copy);
+    }
+
+    /* snapshot readers that raced with the change see the preserved page,
+       pairs with the barrier in pcd_snap_read_iter() */
+    smp_wmb();
+    return ret;
+}
+
+/* pcd_snap_preserve() for every page present in first..last */
+static int pcd_snap_preserve_range(struct pcdev_private_data *dev_data, pgoff_t first, pgoff_t last)
+{
+    struct page *page;
+    unsigned long index;
+    int ret;
+
+    if (list_empty(&dev_data->snapshots))
+    {
+        return 0;
+    }
+
+    xa_for_each_range(&dev_data->pages, index, page, first, last)
+    {
+        ret = pcd_snap_preserve(dev_data, index);
+        if (ret)
+        {
+            return ret;
+        }
+        cond_resched();
+    }
+
+    return 0;
+}
+
+/* Copies @count bytes of the device storage at @pos into @to */
+static ssize_t pcd_storage_read(struct pcdev_private_data *dev_data, loff_t pos, size_t count, struct iov_iter *to)
+{
+    size_t done = 0;
+
+    while (done < count)
+    {
+        pgoff_t index = (pos + done) >> PAGE_SHIFT;
+        size_t offset = (pos + done) & ~PAGE_MASK;
+        size_t bytes = min_t(size_t, count - done, PAGE_SIZE - offset);
+        size_t copied;
+        void *page;
+        void *addr;
+        int ret;
+
+        /* holes are read as zeros without allocating anything */
+        page = pcd_storage_get(dev_data, index);
+        if (IS_ERR(page))
+        {
+            return done ? done : PTR_ERR(page);
+        }
+        if (page)
+        {
+            ret = pcd_csum_verify(dev_data, index, page);
+            if (ret)
+            {
+                return done ? done : ret;
+            }
+            /* a pipe gets a reference to a real page instead of a copy */
+            if (dev_data->persist_mem)
+            {
+                addr = pcd_storage_map(dev_data, page);
+                copied = copy_to_iter(addr + offset, bytes, to);
+                pcd_storage_unmap(dev_data, addr);
+            }
+            else
+            {
+                copied = copy_page_to_iter(page, offset, bytes, to);
+            }
+        }
+        else
+        {
+            copied = iov_iter_zero(bytes, to);
+        }
+        done += copied;
+        if (copied != bytes)
+        {
+            return done ? done : -EFAULT;
+        }
+    }
+
+    return done;
+}
+
+/* Copies @count bytes from @from into the device storage at @pos */
+static ssize_t pcd_storage_write(struct pcdev_private_data *dev_data, loff_t pos, size_t count, struct iov_iter *from)
+{
+    size_t done = 0;
+
+    while (done < count)
+    {
+        pgoff_t index = (pos + done) >> PAGE_SHIFT;
+        size_t offset = (pos + done) & ~PAGE_MASK;
+        size_t bytes = min_t(size_t, count - done, PAGE_SIZE - offset);
+        size_t copied;
+        void *page;
+        void *addr;
+
+        if (pcd_snap_preserve(dev_data, index))
+        {
+            return done ? done : -ENOMEM;
+        }
+
+        page = pcd_storage_page(dev_data, index);
+        if (!page)
+        {
+            return done ? done : -ENOMEM;
+        }
+
+        pcd_csum_lock(dev_data, index);
+        addr = pcd_storage_map(dev_data, page);
+        copied = copy_from_iter(addr + offset, bytes, from);
+        pcd_storage_unmap(dev_data, addr);
+        pcd_csum_update(dev_data, index, page);
+        pcd_csum_unlock(dev_data, index);
+        pcd_storage_dirty(dev_data, index);
+        done += copied;
+        if (copied != bytes)
+        {
+            return done ? done : -EFAULT;
+        }
+    }
+
+    return done;
+}
+
+/* Zeroes a part of a single page, holes are left alone */
+static int pcd_storage_zero(struct pcdev_private_data *dev_data, loff_t pos, size_t len)
+{
+    void *page = pcd_storage_get(dev_data, pos >> PAGE_SHIFT);
+    void *addr;
+
+    if (IS_ERR(page))
+    {
+        return PTR_ERR(page);
+    }
+
+    if (page)
+    {
+        if (pcd_snap_preserve(dev_data, pos >> PAGE_SHIFT))
+        {
+            return -ENOMEM;
+        }
+        pcd_csum_lock(dev_data, pos >> PAGE_SHIFT);
+        addr = pcd_storage_map(dev_data, page);
+        memset(addr + (pos & ~PAGE_MASK), 0, len);
+        pcd_storage_unmap(dev_data, addr);
+        pcd_csum_update(dev_data, pos >> PAGE_SHIFT, page);
+        pcd_csum_unlock(dev_data, pos >> PAGE_SHIFT);
+        pcd_storage_dirty(dev_data, pos >> PAGE_SHIFT);
+    }
+
+    return 0;
+}
+
+/* Copies @count bytes between two places of the device storage, which may
+   belong to different devices. Source holes stay holes in the destination
+   unless the destination page is already present */
+static ssize_t pcd_storage_copy(struct pcdev_private_data *dst_dev, loff_t dst,
+                         struct pcdev_private_data *src_dev, loff_t src, size_t count)
+{
+    size_t done = 0;
+
+    while (done < count)
+    {
+        size_t offset = (src + done) & ~PAGE_MASK;
+        size_t bytes = min_t(size_t, count - done, PAGE_SIZE - offset);
+        struct iov_iter iter;
+        struct kvec kv;
+        void *page;
+        ssize_t copied;
+        int ret;
+
+        page = pcd_storage_get(src_dev, (src + done) >> PAGE_SHIFT);
+        if (IS_ERR(page))
+        {
+            return done ? done : PTR_ERR(page);
+        }
+        if (!page)
+        {
+            /* the write may cross a destination page boundary */
+            size_t head = min_t(size_t, bytes, PAGE_SIZE - ((dst + done) & ~PAGE_MASK));
+
+            ret = pcd_storage_zero(dst_dev, dst + done, head);
+            if (!ret && head < bytes)
+            {
+                ret = pcd_storage_zero(dst_dev, dst + done + head, bytes - head);
+            }
+            if (ret)
+            {
+                return done ? done : ret;
+            }
+            done += bytes;
+            continue;
+        }
+
+        /* a damaged page must not end up elsewhere with a valid checksum */
+        ret = pcd_csum_verify(src_dev, (src + done) >> PAGE_SHIFT, page);
+        if (ret)
+        {
+            return done ? done : ret;
+        }
+
+        kv.iov_base = pcd_storage_map(src_dev, page) + offset;
+        kv.iov_len = bytes;
+        iov_iter_kvec(&iter, WRITE, &kv, 1, bytes);
+        copied = pcd_storage_write(dst_dev, dst + done, bytes, &iter);
+        pcd_storage_unmap(src_dev, kv.iov_base);
+
+        if (copied < 0)
+        {
+            return done ? done : copied;
+        }
+        done += copied;
+    }
+
+    return done;
+}
+
+/* Sets @count bytes of the storage at @pos to @value. Zero fills leave the
+   holes alone */
+static ssize_t pcd_storage_fill(struct pcdev_private_data *dev_data, loff_t pos, size_t count, u8 value)
+{
+    size_t done = 0;
+
+    while (done < count)
+    {
+        size_t offset = (pos + done) & ~PAGE_MASK;
+        size_t bytes = min_t(size_t, count - done, PAGE_SIZE - offset);
+        void *page;
+        void *addr;
+        int ret;
+
+        if (!value)
+        {
+            ret = pcd_storage_zero(dev_data, pos + done, bytes);
+            if (ret)
+            {
+                return done ? done : ret;
+            }
+            done += bytes;
+            continue;
+        }
+
+        if (pcd_snap_preserve(dev_data, (pos + done) >> PAGE_SHIFT))
+        {
+            return done ? done : -ENOMEM;
+        }
+
+        page = pcd_storage_page(dev_data, (pos + done) >> PAGE_SHIFT);
+        if (!page)
+        {
+            return done ? done : -ENOMEM;
+        }
+
+        pcd_csum_lock(dev_data, (pos + done) >> PAGE_SHIFT);
+        addr = pcd_storage_map(dev_data, page);
+        memset(addr + offset, value, bytes);
+        pcd_storage_unmap(dev_data, addr);
+        pcd_csum_update(dev_data, (pos + done) >> PAGE_SHIFT, page);
+        pcd_csum_unlock(dev_data, (pos + done) >> PAGE_SHIFT);
+        pcd_storage_dirty(dev_data, (pos + done) >> PAGE_SHIFT);
+        done += bytes;
+    }
+
+    return done;
+}
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 19, 0)
+/* CRC32C of @count bytes of the storage at @pos, holes count as zeros. Only
+   PCD_URING_CMD_CHECKSUM needs it */
+static int pcd_storage_crc32c(struct pcdev_private_data *dev_data, loff_t pos, size_t count, u32 *result)
+{
+    u32 crc = ~0U;
+    size_t done = 0;
+
+    while (done < count)
+    {
+        size_t offset = (pos + done) & ~PAGE_MASK;
+        size_t bytes = min_t(size_t, count - done, PAGE_SIZE - offset);
+        void *page;
+        void *addr;
+        int ret;
+
+        page = pcd_storage_get(dev_data, (pos + done) >> PAGE_SHIFT);
+        if (IS_ERR(page))
+        {
+            return PTR_ERR(page);
+        }
+        if (page)
+        {
+            ret = pcd_csum_verify(dev_data, (pos + done) >> PAGE_SHIFT, page);
+            if (ret)
+            {
+                return ret;
+            }
+            addr = pcd_storage_map(dev_data, page);
+            crc = crc32c(crc, addr + offset, bytes);
+            pcd_storage_unmap(dev_data, addr);
+        }
+        else
+        {
+            crc = crc32c(crc, page_address(ZERO_PAGE(0)) + offset, bytes);
+        }
+        done += bytes;
+
+        cond_resched();
+    }
+
+    *result = ~crc;
+    return 0;
+}
+#endif
+
+/* Bounds checked pcd_storage_copy(), the caller holds the write lock of the
+   destination and at least the read lock of the source */
+static ssize_t pcd_copy_range(struct pcdev_private_data *dst_dev, u64 dst,
+                       struct pcdev_private_data *src_dev, u64 src, u64 len)
+{
+    if (len > dst_dev->pdata.size || dst > dst_dev->pdata.size - len ||
+        len > src_dev->pdata.size || src > src_dev->pdata.size - len)
+    {
+        return -EINVAL;
+    }
+
+    if (dst_dev == src_dev && src < dst + len && dst < src + len)
+    {
+        return -EINVAL;
+    }
+
+    if (len > MAX_RW_COUNT)
+    {
+        len = MAX_RW_COUNT;
+    }
+
+    return pcd_storage_copy(dst_dev, dst, src_dev, src, len);
+}
+
+/* Releases the pages first..last (inclusive), they become holes */
+static int pcd_storage_punch(struct pcdev_private_data *dev_data, pgoff_t first, pgoff_t last)
+{
+    XA_STATE(xas, &dev_data->pages, first);
+    unsigned int batch = 0;
+    unsigned long index;
+    void *page;
+    void *addr;
+    int ret;
+
+    /* snapshots keep the old contents, nothing is released if that fails */
+    ret = pcd_snap_preserve_range(dev_data, first, last);
+    if (ret)
+    {
+        return ret;
+    }
+
+    /* Pages of a reserved memory region cannot be given back, and the
+       range has to become a hole in the backing file as well. Where that
+       is not possible the pages are zeroed in place */
+    if (dev_data->persist_mem ||
+        (dev_data->backing &&
+         vfs_fallocate(dev_data->backing, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+                       (loff_t)first << PAGE_SHIFT, (loff_t)(last - first + 1) << PAGE_SHIFT)))
+    {
+        xa_for_each_range(&dev_data->pages, index, page, first, last)
+        {
+            addr = pcd_storage_map(dev_data, page);
+            memset(addr, 0, PAGE_SIZE);
+            pcd_storage_unmap(dev_data, addr);
+            pcd_csum_update(dev_data, index, page);
+            pcd_storage_dirty(dev_data, index);
+            cond_resched();
+        }
+        return 0;
+    }
+
+    xas_lock(&xas);
+    xas_for_each(&xas, page, last)
+    {
+        xas_store(&xas, NULL);
+        pcd_storage_release(dev_data, page);
+        pcd_csum_clear(dev_data, xas.xa_index);
+
+        /* do not hold the lock for too long on huge ranges */
+        if (++batch % 64 == 0)
+        {
+            xas_pause(&xas);
+            xas_unlock(&xas);
+            cond_resched();
+            xas_lock(&xas);
+        }
+    }
+    xas_unlock(&xas);
+
+    return 0;
+}
+
+/* Finds the first byte of data (or of a hole) at or after @offset. The end
+   of the device counts as a hole */
+static loff_t pcd_storage_seek(struct pcdev_private_data *dev_data, loff_t offset, bool data)
+{
+    loff_t max_size = dev_data->pdata.size;
+    pgoff_t index = offset >> PAGE_SHIFT;
+    pgoff_t last = (max_size - 1) >> PAGE_SHIFT;
+    XA_STATE(xas, &dev_data->pages, index);
+    unsigned int batch = 0;
+    struct page *page;
+
+    if (data)
+    {
+        if (!xa_find(&dev_data->pages, &index, last, XA_PRESENT))
+        {
+            return -ENXIO;
+        }
+    }
+    else
+    {
+        /* every present page is stepped over, a fully populated device
+           does not get to stay in one RCU read section for all of them */
+        rcu_read_lock();
+        for (page = xas_load(&xas); xas.xa_index <= last; page = xas_next(&xas))
+        {
+            if (xas_retry(&xas, page))
+            {
+                continue;
+            }
+            if (!page)
+            {
+                break;
+            }
+            if (++batch % 256 == 0)
+            {
+                xas_pause(&xas);
+                rcu_read_unlock();
+                cond_resched();
+                rcu_read_lock();
+            }
+        }
+        rcu_read_unlock();
+        index = xas.xa_index;
+    }
+
+    return min_t(loff_t, max_size, max_t(loff_t, offset, (loff_t)index << PAGE_SHIFT));
+}
+
+/* Gives the memory backing a byte range back to the system */
+static long pcd_discard(struct pcdev_private_data *dev_data, u64 offset, u64 len)
+{
+    u64 max_size;
+    u64 end = offset + len;
+    u64 first = round_up(offset, PAGE_SIZE);
+    u64 last = round_down(end, PAGE_SIZE);
+    long ret = 0;
+
+    if (dev_data->pdata.mode == PCD_MODE_FIFO)
+    {
+        return -EINVAL;
+    }
+
+    if (!len)
+    {
+        return 0;
+    }
+
+    pcd_down_write(&dev_data->lock);
+
+    max_size = dev_data->pdata.size;
+    if (offset > max_size || len > max_size - offset)
+    {
+        ret = -EINVAL;
+        goto out;
+    }
+
+    /* pages cannot be taken away from under a user space mapping */
+    if (atomic_read(&dev_data->nr_mmaps))
+    {
+        ret = -EBUSY;
+        goto out;
+    }
+
+    /* partial pages at the edges are zeroed, whole pages are released */
+    if (offset < first)
+    {
+        ret = pcd_storage_zero(dev_data, offset, min(first, end) - offset);
+    }
+    if (!ret && last < end && last >= first)
+    {
+        ret = pcd_storage_zero(dev_data, last, end - last);
+    }
+    if (!ret && first < last)
+    {
+        ret = pcd_storage_punch(dev_data, first >> PAGE_SHIFT, (last >> PAGE_SHIFT) - 1);
+    }
+
+out:
+    pcd_up_write(&dev_data->lock);
+    return ret;
+}
+
+/* Changes the size of a live device. Readers and writers check their
+   bounds under the device lock, so they see either the old or the new size */
+static long pcd_resize(struct pcdev_private_data *dev_data, u64 new_size)
+{
+    u64 old_size;
+    u64 first;
+    long ret = 0;
+
+    if (dev_data->pdata.mode == PCD_MODE_FIFO)
+    {
+        return -EINVAL;
+    }
+
+    if (!new_size || new_size > MAX_LFS_FILESIZE)
+    {
+        return -EINVAL;
+    }
+
+    /* persistent contents keep the size they were attached with */
+    if (dev_data->persist_mem || dev_data->backing)
+    {
+        return -EINVAL;
+    }
+
+    pcd_down_write(&dev_data->lock);
+
+    old_size = dev_data->pdata.size;
+    if (new_size < old_size)
+    {
+        /* pages cannot be taken away from under a user space mapping */
+        if (atomic_read(&dev_data->nr_mmaps))
+        {
+            ret = -EBUSY;
+            goto out;
+        }
+
+        /* the cut off part of the last page has to read back as zeros
+           once the device grows again */
+        first = round_up(new_size, PAGE_SIZE);
+        if (new_size < first)
+        {
+            ret = pcd_storage_zero(dev_data, new_size, min(first, old_size) - new_size);
+        }
+        if (!ret && first < old_size)
+        {
+            ret = pcd_storage_punch(dev_data, first >> PAGE_SHIFT, (old_size - 1) >> PAGE_SHIFT);
+        }
+        if (ret)
+        {
+            goto out;
+        }
+    }
+
+    /* growing needs nothing else, the new pages are holes */
+    WRITE_ONCE(dev_data->pdata.size, new_size);
+
+out:
+    pcd_up_write(&dev_data->lock);
+
+    /* block requests check the size under the lock as well, the capacity
+       only tells the block layer about it */
+    if (!ret && dev_data->disk)
+    {
+        set_capacity_and_notify(dev_data->disk, new_size >> SECTOR_SHIFT);
+    }
+    return ret;
+}
+
+/* Releases the device storage, see pcd_dev_release() */
+static void pcd_storage_free(struct pcdev_private_data *dev_data)
+{
+    struct page *page;
+    unsigned long index;
+
+    /* pages still mapped into user space are released on munmap, pages of
+       a reserved memory region are never released. The compressed storage
+       is gone already, its pages are freed without the accounting */
+    if (!dev_data->persist_mem)
+    {
+        xa_for_each(&dev_data->pages, index, page)
+        {
+            if (xa_pointer_tag(page) == PCD_ZPAGE_TAG)
+            {
+                kfree(xa_untag_pointer(page));
+            }
+            else
+            {
+                put_page(page);
+            }
+        }
+    }
+    xa_destroy(&dev_data->pages);
+}
+
+/*
+ * Persistence.
+ *
+ * A reserved memory region holds the storage pages themselves and a header
+ * in its last page. The memory is never freed, so when the driver is loaded
+ * again or the system is rebooted without losing the RAM contents, a valid
+ * header matching the device lets it reattach to the data at once. Without
+ * one the region is cleared. The region may be "no-map", the driver maps it
+ * itself and user space mappings get its pages by PFN, so private mappings
+ * of such a device are read-only:
+ *
+ *   reserved-memory {
+ *       #address-cells = <1>;
+ *       #size-cells = <1>;
+ *       ranges;
+ *       pcd_mem: pcd@9f000000 {
+ *           reg = <0x9f000000 0x101000>;
+ *       };
+ *   };
+ *   pcdev-1 {
+ *       ...
+ *       org,size = <0x100000>;
+ *       memory-region = <&pcd_mem>;
+ *   };
+ *
+ * With a backing file (org,backing-file = "/var/lib/pcd/pcdev-1.img" or the
+ * configfs backing_file attribute) the data extents of the file are read at
+ * probe. Modified pages are marked PCD_PAGE_DIRTY and written back every
+ * writeback_ms, on fsync() and when the device goes away. Writes through a
+ * shared mapping are not seen, pages of writable mappings are marked
+ * PCD_PAGE_MAPPED instead and written back on every pass while mapped.
+ */
+#define PCD_PERSIST_MAGIC 0x50434450 /* "PCDP" */
+#define PCD_PERSIST_VERSION 1
+
+struct pcd_persist_header
+{
+    u32 magic;
+    u32 version;
+    u64 size;
+    char serial_number[32];
+    u32 crc; /* CRC32C of everything above */
+};
+
+/* Uses the pages of a reserved memory region as the device storage. They
+   may have no struct pages, the storage holds their addresses instead, see
+   pcd_storage_map() */
+static int pcd_persist_mem_attach(struct pcdev_private_data *dev_data, struct device *dev)
+{
+    pgoff_t nr = DIV_ROUND_UP(dev_data->pdata.size, PAGE_SIZE);
+    struct pcd_persist_header *hdr;
+    struct pcd_persist_header want;
+    bool valid;
+    pgoff_t i;
+    int ret;
+
+    /* the header takes one page after the data */
+    if (!PAGE_ALIGNED(dev_data->pdata.mem_base) || dev_data->pdata.mem_size < ((u64)nr + 1) << PAGE_SHIFT)
+    {
+        dev_err(dev, "The memory region has to be page aligned and hold size + %lu bytes\n", PAGE_SIZE);
+        return -EINVAL;
+    }
+
+    /* unmapped in pcd_dev_release() */
+    dev_data->mem = memremap(dev_data->pdata.mem_base, ((size_t)nr + 1) << PAGE_SHIFT, MEMREMAP_WB);
+    if (!dev_data->mem)
+    {
+        dev_err(dev, "Cannot map the memory region\n");
+        return -ENOMEM;
+    }
+    hdr = dev_data->mem + ((size_t)nr << PAGE_SHIFT);
+
+    memset(&want, 0, sizeof(want));
+    want.magic = PCD_PERSIST_MAGIC;
+    want.version = PCD_PERSIST_VERSION;
+    want.size = dev_data->pdata.size;
+    strscpy(want.serial_number, dev_data->pdata.serial_number, sizeof(want.serial_number));
+    want.crc = crc32c(~0, &want, offsetof(struct pcd_persist_header, crc));
+
+    /* the header is written last, an interrupted clear is redone */
+    valid = !memcmp(hdr, &want, sizeof(want));
+    if (!valid)
+    {
+        dev_info(dev, "No contents to reattach, clearing the memory region\n");
+        memset(hdr, 0, sizeof(*hdr));
+        for (i = 0; i < nr; i++)
+        {
+            memset(dev_data->mem + ((size_t)i << PAGE_SHIFT), 0, PAGE_SIZE);
+            cond_resched();
+        }
+        memcpy(hdr, &want, sizeof(want));
+    }
+
+    /* from here on the pages must not be released, see pcd_storage_free() */
+    dev_data->persist_mem = true;
+    for (i = 0; i < nr; i++)
+    {
+        ret = xa_err(xa_store(&dev_data->pages, i, dev_data->mem + ((size_t)i << PAGE_SHIFT), GFP_KERNEL));
+        if (ret)
+        {
+            return ret;
+        }
+    }
+    atomic_long_set(&dev_data->nr_pages, nr);
+
+    dev_dbg(dev, "%s %lu pages of persistent memory\n", valid ? "Reattached" : "Initialized", nr);
+    return 0;
+}
+
+/* Writes one storage page back, the caller holds the device lock */
+static int pcd_persist_write_page(struct pcdev_private_data *dev_data, pgoff_t index, struct page *page)
+{
+    loff_t pos = (loff_t)index << PAGE_SHIFT;
+    size_t len = min_t(u64, PAGE_SIZE, dev_data->pdata.size - pos);
+    void *addr;
+    ssize_t ret;
+
+    addr = kmap_local_page(page);
+    ret = kernel_write(dev_data->backing, addr, len, &pos);
+    kunmap_local(addr);
+
+    if (ret < 0)
+    {
+        return ret;
+    }
+    return ret == len ? 0 : -EIO;
+}
+
+/* Writes the dirty pages and those of writable mappings to the backing
+   file. The device lock keeps discards from releasing the pages meanwhile */
+static int pcd_persist_writeback(struct pcdev_private_data *dev_data)
+{
+    unsigned long index;
+    struct page *page;
+    int ret = 0;
+    int err;
+    unsigned int slot;
+
+    slot = pcd_down_read(&dev_data->lock);
+
+    xa_for_each_marked(&dev_data->pages, index, page, PCD_PAGE_DIRTY)
+    {
+        /* cleared before the page is read, a write that comes in meanwhile
+           marks it again (see pcd_storage_dirty()) */
+        xa_clear_mark(&dev_data->pages, index, PCD_PAGE_DIRTY);
+        smp_mb();
+
+        err = pcd_persist_write_page(dev_data, index, page);
+        if (err)
+        {
+            xa_set_mark(&dev_data->pages, index, PCD_PAGE_DIRTY);
+            ret = err;
+        }
+
+        if (need_resched())
+        {
+            pcd_up_read(&dev_data->lock, slot);
+            cond_resched();
+            slot = pcd_down_read(&dev_data->lock);
+        }
+    }
+
+    xa_for_each_marked(&dev_data->pages, index, page, PCD_PAGE_MAPPED)
+    {
+        /* the last pass once the device got unmapped clears the mark */
+        pcd_storage_unmapped(dev_data, index, page);
+
+        err = pcd_persist_write_page(dev_data, index, page);
+        if (err)
+        {
+            ret = err;
+        }
+
+        if (need_resched())
+        {
+            pcd_up_read(&dev_data->lock, slot);
+            cond_resched();
+            slot = pcd_down_read(&dev_data->lock);
+        }
+    }
+
+    pcd_up_read(&dev_data->lock, slot);
+    return ret;
+}
+
+/* Makes everything written so far durable */
+static int pcd_persist_sync(struct pcdev_private_data *dev_data, int datasync)
+{
+    int ret;
+
+    if (!dev_data->backing)
+    {
+        return 0;
+    }
+
+    ret = pcd_persist_writeback(dev_data);
+    if (ret)
+    {
+        return ret;
+    }
+    return vfs_fsync(dev_data->backing, datasync);
+}
+
+static void pcd_persist_work(struct work_struct *work)
+{
+    struct pcdev_private_data *dev_data = container_of(to_delayed_work(work), struct pcdev_private_data,
+                                                       writeback_work);
+    int ret;
+
+    ret = pcd_persist_writeback(dev_data);
+    if (ret)
+    {
+        pr_err_ratelimited("Write-back to %pD failed (%d)\n", dev_data->backing, ret);
+    }
+
+    queue_delayed_work(system_long_wq, &dev_data->writeback_work, msecs_to_jiffies(writeback_ms));
+}
+
+/* Runs once the last reference to the device is gone and nobody writes to it anymore */
+static void pcd_persist_detach(struct pcdev_private_data *dev_data)
+{
+    cancel_delayed_work_sync(&dev_data->writeback_work);
+    if (pcd_persist_sync(dev_data, 0))
+    {
+        pr_err("Final write-back to %pD failed, data is lost\n", dev_data->backing);
+    }
+    filp_close(dev_data->backing, NULL);
+    dev_data->backing = NULL;
+}
+
+/* Reads one page of the backing file into the storage */
+static int pcd_persist_read_page(struct pcdev_private_data *dev_data, loff_t pos)
+{
+    size_t len = min_t(u64, PAGE_SIZE, dev_data->pdata.size - pos);
+    struct page *page;
+    void *addr;
+    ssize_t ret;
+
+    page = pcd_storage_page(dev_data, pos >> PAGE_SHIFT);
+    if (!page)
+    {
+        return -ENOMEM;
+    }
+
+    addr = kmap_local_page(page);
+    ret = kernel_read(dev_data->backing, addr, len, &pos);
+    kunmap_local(addr);
+
+    return ret < 0 ? ret : 0;
+}
+
+/* Opens the backing file and loads its contents, holes of a sparse file
+   stay holes of the device */
+static int pcd_persist_file_attach(struct pcdev_private_data *dev_data, struct device *dev)
+{
+    loff_t size = dev_data->pdata.size;
+    struct file *file;
+    loff_t pos = 0;
+    loff_t end;
+    int ret;
+
+    file = filp_open(dev_data->pdata.backing_file, O_RDWR | O_CREAT | O_LARGEFILE, 0600);
+    if (IS_ERR(file))
+    {
+        dev_err(dev, "Cannot open %s (%ld)\n", dev_data->pdata.backing_file, PTR_ERR(file));
+        return PTR_ERR(file);
+    }
+
+    /* detached by pcd_dev_release(), also when the probe fails */
+    dev_data->backing = file;
+    INIT_DELAYED_WORK(&dev_data->writeback_work, pcd_persist_work);
+
+    if (i_size_read(file_inode(file)) != size)
+    {
+        ret = vfs_truncate(&file->f_path, size);
+        if (ret)
+        {
+            return ret;
+        }
+    }
+
+    while (pos < size)
+    {
+        pos = vfs_llseek(file, pos, SEEK_DATA);
+        if (pos == -ENXIO)
+        {
+            break;
+        }
+        if (pos < 0)
+        {
+            return pos;
+        }
+
+        end = vfs_llseek(file, pos, SEEK_HOLE);
+        if (end < 0)
+        {
+            return end;
+        }
+        end = min(end, size);
+
+        for (pos = round_down(pos, PAGE_SIZE); pos < end; pos += PAGE_SIZE)
+        {
+            ret = pcd_persist_read_page(dev_data, pos);
+            if (ret)
+            {
+                return ret;
+            }
+            cond_resched();
+        }
+    }
+
+    queue_delayed_work(system_long_wq, &dev_data->writeback_work, msecs_to_jiffies(writeback_ms));
+
+    dev_dbg(dev, "Loaded %ld pages from %s\n", atomic_long_read(&dev_data->nr_pages),
+            dev_data->pdata.backing_file);
+    return 0;
+}
+
+/* Attaches the device to its persistent contents, if it has any */
+static int pcd_persist_attach(struct pcdev_private_data *dev_data, struct device *dev)
+{
+    if (!dev_data->pdata.mem_size && !dev_data->pdata.backing_file)
+    {
+        return 0;
+    }
+
+    if (dev_data->pdata.mem_size && dev_data->pdata.backing_file)
+    {
+        dev_err(dev, "Either a memory region or a backing file can be used\n");
+        return -EINVAL;
+    }
+
+    /* the position of FIFO data is not persisted */
+    if (dev_data->pdata.mode == PCD_MODE_FIFO)
+    {
+        dev_err(dev, "FIFO devices cannot be persistent\n");
+        return -EINVAL;
+    }
+
+    if (dev_data->pdata.mem_size)
+    {
+        return pcd_persist_mem_attach(dev_data, dev);
+    }
+    return pcd_persist_file_attach(dev_data, dev);
+}
+
+/*
+ * Compressed storage (org,compress = "lz4" or "lzo", or the configfs
+ * compress attribute).
+ *
+ * Every compress_ms a scan walks the pages of the device. A page accessed
+ * since the last scan is marked PCD_PAGE_HOT, the scan clears the mark. A
+ * page still unmarked is cold: it is released if it only holds zeros and
+ * compressed otherwise. The next access decompresses it into a page of its
+ * own again. The scan takes the device lock in batches and skips devices
+ * that are mapped or have snapshots, those may use the pages directly.
+ * The results are in /sys/class/pcd_class/pcdev-N/compression.
+ */
+#define PCD_ZSTORE_BATCH 256
+
+/* Compresses a cold page, the caller holds the write lock */
+static void pcd_zstore_page(struct pcdev_private_data *dev_data, pgoff_t index, struct page *page)
+{
+    struct pcd_zstore *zs = dev_data->zstore;
+    struct pcd_zpage *zp;
+    void *addr;
+    size_t len;
+    u64 start;
+
+    addr = kmap_local_page(page);
+
+    /* pages of zeros become holes, they cost nothing */
+    if (!memchr_inv(addr, 0, PAGE_SIZE))
+    {
+        kunmap_local(addr);
+        xa_erase(&dev_data->pages, index);
+        pcd_csum_clear(dev_data, index);
+        put_page(page);
+        atomic_long_dec(&dev_data->nr_pages);
+        atomic64_inc(&zs->zero_pages);
+        return;
+    }
+
+    start = ktime_get_ns();
+    len = zs->comp->compress(addr, zs->buf, PCD_ZPAGE_MAX, zs->wrkmem);
+    kunmap_local(addr);
+    atomic64_add(ktime_get_ns() - start, &zs->compress_ns);
+    atomic64_inc(&zs->compressions);
+
+    /* tried again on the next scan, the contents may have changed by then */
+    if (!len)
+    {
+        atomic64_inc(&zs->incompressible);
+        return;
+    }
+
+    zp = kmalloc(struct_size(zp, data, len), GFP_KERNEL | __GFP_NOWARN);
+    if (!zp)
+    {
+        return;
+    }
+    zp->len = len;
+    memcpy(zp->data, zs->buf, len);
+
+    /* the slot exists, replacing its entry does not allocate */
+    xa_store(&dev_data->pages, index, xa_tag_pointer(zp, PCD_ZPAGE_TAG), GFP_KERNEL);
+    put_page(page);
+    atomic_long_dec(&dev_data->nr_pages);
+    atomic_long_inc(&zs->nr_zpages);
+    atomic_long_add(len, &zs->compr_bytes);
+    atomic_long_add(ksize(zp), &zs->mem_bytes);
+}
+
+/* Scans up to PCD_ZSTORE_BATCH pages from *@index on, returns false once
+   the end of the device is reached */
+static bool pcd_zstore_scan(struct pcdev_private_data *dev_data, unsigned long *index)
+{
+    unsigned int nr = 0;
+    unsigned long i;
+    void *entry;
+
+    xa_for_each_range(&dev_data->pages, i, entry, *index, ULONG_MAX)
+    {
+        if (++nr > PCD_ZSTORE_BATCH)
+        {
+            *index = i;
+            return true;
+        }
+
+        if (xa_pointer_tag(entry) == PCD_ZPAGE_TAG)
+        {
+            continue;
+        }
+
+        /* second chance for pages accessed since the last scan */
+        if (xa_get_mark(&dev_data->pages, i, PCD_PAGE_HOT))
+        {
+            xa_clear_mark(&dev_data->pages, i, PCD_PAGE_HOT);
+            continue;
+        }
+
+        pcd_zstore_page(dev_data, i, entry);
+    }
+
+    return false;
+}
+
+static void pcd_zstore_work(struct work_struct *work)
+{
+    struct pcd_zstore *zs = container_of(to_delayed_work(work), struct pcd_zstore, work);
+    struct pcdev_private_data *dev_data = zs->dev_data;
+    unsigned long index = 0;
+    unsigned int noio_flags;
+    bool more = true;
+
+    while (more)
+    {
+        pcd_down_write(&dev_data->lock);
+
+        /* pages of mappings and snapshots are used without the lock */
+        if (atomic_read(&dev_data->nr_mmaps) || !list_empty(&dev_data->snapshots))
+        {
+            pcd_up_write(&dev_data->lock);
+            break;
+        }
+
+        /* allocations must not recurse into I/O to the block device, its
+           requests wait for the lock */
+        noio_flags = memalloc_noio_save();
+        more = pcd_zstore_scan(dev_data, &index);
+        memalloc_noio_restore(noio_flags);
+
+        pcd_up_write(&dev_data->lock);
+        cond_resched();
+    }
+
+    queue_delayed_work(system_long_wq, &zs->work, msecs_to_jiffies(compress_ms));
+}
+
+/* Stops the scan, the compressed pages are released with the storage */
+static void pcd_zstore_detach(struct pcd_zstore *zs)
+{
+    cancel_delayed_work_sync(&zs->work);
+    kvfree(zs->wrkmem);
+    kfree(zs->buf);
+    kfree(zs);
+}
+
+/* Sets up the compressed storage of the device, if it asks for one */
+static int pcd_zstore_attach(struct pcdev_private_data *dev_data, struct device *dev)
+{
+    const struct pcd_compressor *comp = NULL;
+    struct pcd_zstore *zs;
+    int i;
+
+    if (!dev_data->pdata.compressor)
+    {
+        return 0;
+    }
+
+    for (i = 0; i < ARRAY_SIZE(pcd_compressors); i++)
+    {
+        if (!strcmp(dev_data->pdata.compressor, pcd_compressors[i].name))
+        {
+            comp = &pcd_compressors[i];
+        }
+    }
+    if (!comp)
+    {
+        dev_err(dev, "Unknown compressor %s\n", dev_data->pdata.compressor);
+        return -EINVAL;
+    }
+
+    /* persistent pages are written back or live in reserved memory */
+    if (dev_data->pdata.mode == PCD_MODE_FIFO || dev_data->persist_mem || dev_data->backing)
+    {
+        dev_err(dev, "Only volatile linear devices can be compressed\n");
+        return -EINVAL;
+    }
+
+    zs = kzalloc(sizeof(*zs), GFP_KERNEL);
+    if (!zs)
+    {
+        return -ENOMEM;
+    }
+
+    zs->dev_data = dev_data;
+    zs->comp = comp;
+    mutex_init(&zs->lock);
+    INIT_DELAYED_WORK(&zs->work, pcd_zstore_work);
+    zs->wrkmem = kvmalloc(comp->wrkmem_size, GFP_KERNEL);
+    zs->buf = kmalloc(lzo1x_worst_compress(PAGE_SIZE), GFP_KERNEL);
+
+    if (!zs->wrkmem || !zs->buf)
+    {
+        pcd_zstore_detach(zs);
+        return -ENOMEM;
+    }
+
+    dev_data->zstore = zs;
+    queue_delayed_work(system_long_wq, &zs->work, msecs_to_jiffies(compress_ms));
+    return 0;
+}
+
+/*
+ * Per-page checksums (org,checksum or the configfs checksum attribute).
+ *
+ * The CRC32C of every page is kept in chunks next to the storage, updated
+ * by every change made through the driver. Reads, copies and checksum
+ * commands check a page before they use it and fail with EIO when it does
+ * not match, PCD_IOC_VERIFY checks a range on demand. A scrubber walks all
+ * pages every scrub_ms so that damage is found before the data is needed.
+ * Compressed pages keep their checksum and are checked once decompressed,
+ * the scrubber leaves them alone. Pages of shared writable mappings are not
+ * checked until the device is unmapped. The results are in
+ * /sys/class/pcd_class/pcdev-N/checksum.
+ */
+#define PCD_CSUM_BATCH 256
+
+/* Checks up to PCD_CSUM_BATCH pages from *@index on, returns false once the
+   end of the device is reached */
+static bool pcd_csum_scrub(struct pcdev_private_data *dev_data, unsigned long *index)
+{
+    struct pcd_csum *cs = dev_data->csum;
+    unsigned int nr = 0;
+    unsigned long i;
+    void *entry;
+
+    xa_for_each_range(&dev_data->pages, i, entry, *index, ULONG_MAX)
+    {
+        if (++nr > PCD_CSUM_BATCH)
+        {
+            *index = i;
+            return true;
+        }
+
+        if (xa_pointer_tag(entry) == PCD_ZPAGE_TAG)
+        {
+            continue;
+        }
+
+        if (xa_get_mark(&dev_data->pages, i, PCD_PAGE_MAPPED))
+        {
+            pcd_storage_unmapped(dev_data, i, entry);
+        }
+
+        /* mismatches are counted and reported by the check */
+        pcd_csum_verify(dev_data, i, entry);
+        atomic64_inc(&cs->scrubbed_pages);
+    }
+
+    return false;
+}
+
+static void pcd_csum_work(struct work_struct *work)
+{
+    struct pcd_csum *cs = container_of(to_delayed_work(work), struct pcd_csum, work);
+    struct pcdev_private_data *dev_data = cs->dev_data;
+    unsigned long index = 0;
+    u64 start = ktime_get_ns();
+    bool more = true;
+    unsigned int slot;
+
+    /* the read side keeps discards and compression from releasing pages,
+       I/O goes on meanwhile */
+    while (more)
+    {
+        slot = pcd_down_read(&dev_data->lock);
+        more = pcd_csum_scrub(dev_data, &index);
+        pcd_up_read(&dev_data->lock, slot);
+        cond_resched();
+    }
+
+    atomic64_add(ktime_get_ns() - start, &cs->scrub_ns);
+    atomic64_inc(&cs->scrubs);
+    queue_delayed_work(system_long_wq, &cs->work, msecs_to_jiffies(scrub_ms));
+}
+
+/* Stops the scrubber and frees the checksums */
+static void pcd_csum_detach(struct pcd_csum *cs)
+{
+    unsigned long index;
+    u32 *chunk;
+
+    cancel_delayed_work_sync(&cs->work);
+    xa_for_each(&cs->crcs, index, chunk)
+    {
+        kfree(chunk);
+    }
+    xa_destroy(&cs->crcs);
+    kfree(cs);
+}
+
+/* Sets up the checksums of the device, if it asks for them. Runs before the
+   compressed storage is attached, pages present by now are persistent ones */
+static int pcd_csum_attach(struct pcdev_private_data *dev_data, struct device *dev)
+{
+    struct pcd_csum *cs;
+    unsigned long index;
+    void *page;
+    void *addr;
+    u32 *slot;
+    int i;
+
+    if (!dev_data->pdata.checksum)
+    {
+        return 0;
+    }
+
+    if (dev_data->pdata.mode == PCD_MODE_FIFO)
+    {
+        dev_err(dev, "FIFO devices cannot have checksums\n");
+        return -EINVAL;
+    }
+
+    cs = kzalloc(sizeof(*cs), GFP_KERNEL);
+    if (!cs)
+    {
+        return -ENOMEM;
+    }
+
+    cs->dev_data = dev_data;
+    for (i = 0; i < PCD_CSUM_LOCKS; i++)
+    {
+        mutex_init(&cs->locks[i]);
+    }
+    xa_init(&cs->crcs);
+    cs->zero_crc = pcd_csum_page(page_address(ZERO_PAGE(0)));
+    INIT_DELAYED_WORK(&cs->work, pcd_csum_work);
+
+    xa_for_each(&dev_data->pages, index, page)
+    {
+        slot = pcd_csum_slot(cs, index, true);
+        if (!slot)
+        {
+            pcd_csum_detach(cs);
+            return -ENOMEM;
+        }
+        addr = pcd_storage_map(dev_data, page);
+        *slot = pcd_csum_page(addr);
+        pcd_storage_unmap(dev_data, addr);
+        cond_resched();
+    }
+
+    dev_data->csum = cs;
+    queue_delayed_work(system_long_wq, &cs->work, msecs_to_jiffies(scrub_ms));
+    return 0;
+}
+
+/* Checks a byte range against the checksums, see PCD_IOC_VERIFY */
+static long pcd_verify(struct file *filp, struct pcd_verify __user *uarg)
+{
+    struct pcdev_private_data *dev_data = filp->private_data;
+    struct pcd_verify arg;
+    unsigned long index;
+    void *entry;
+    void *page;
+    long ret = 0;
+    unsigned int slot;
+
+    if (!(filp->f_mode & FMODE_READ))
+    {
+        return -EBADF;
+    }
+
+    if (!dev_data->csum)
+    {
+        return -EOPNOTSUPP;
+    }
+
+    if (copy_from_user(&arg, uarg, sizeof(arg)))
+    {
+        return -EFAULT;
+    }
+
+    arg.pages = 0;
+    arg.errors = 0;
+    arg.first_error = 0;
+
+    slot = pcd_down_read(&dev_data->lock);
+
+    if (arg.len > dev_data->pdata.size || arg.offset > dev_data->pdata.size - arg.len)
+    {
+        ret = -EINVAL;
+        goto unlock;
+    }
+
+    if (!arg.len)
+    {
+        goto unlock;
+    }
+
+    /* holes hold nothing to check */
+    xa_for_each_range(&dev_data->pages, index, entry, arg.offset >> PAGE_SHIFT,
+                      (arg.offset + arg.len - 1) >> PAGE_SHIFT)
+    {
+        page = pcd_storage_get(dev_data, index);
+        if (IS_ERR(page))
+        {
+            ret = PTR_ERR(page);
+            break;
+        }
+
+        if (pcd_csum_verify(dev_data, index, page))
+        {
+            if (!arg.errors)
+            {
+                arg.first_error = (u64)index << PAGE_SHIFT;
+            }
+            arg.errors++;
+        }
+        arg.pages++;
+
+        if (fatal_signal_pending(current))
+        {
+            ret = -EINTR;
+            break;
+        }
+        cond_resched();
+    }
+
+unlock:
+    pcd_up_read(&dev_data->lock, slot);
+
+    if (!ret && copy_to_user(uarg, &arg, sizeof(arg)))
+    {
+        ret = -EFAULT;
+    }
+    return ret;
+}
+
+enum pcd_stat_event
+{
+    PCD_STAT_READ,
+    PCD_STAT_WRITE,
+    PCD_STAT_OPEN,
+    PCD_STAT_RELEASE
+};
+
+/* Accounts an operation on this CPU's counters, @ret is its result */
+static void pcd_stats_account(struct pcdev_private_data *dev_data, enum pcd_stat_event event, ssize_t ret)
+{
+    struct pcd_stats *stats = get_cpu_ptr(dev_data->stats);
+
+    u64_stats_update_begin(&stats->syncp);
+    if (ret == -EFAULT)
+    {
+        stats->efault++;
+    }
+    else if (ret == -ENOMEM)
+    {
+        stats->enomem++;
+    }
+    else if (ret >= 0)
+    {
+        switch (event)
+        {
+            case PCD_STAT_READ:
+                stats->reads++;
+                stats->bytes_read += ret;
+                break;
+            case PCD_STAT_WRITE:
+                stats->writes++;
+                stats->bytes_written += ret;
+                break;
+            case PCD_STAT_OPEN:
+                stats->opens++;
+                break;
+            case PCD_STAT_RELEASE:
+                stats->releases++;
+                break;
+        }
+    }
+    u64_stats_update_end(&stats->syncp);
+
+    put_cpu_ptr(dev_data->stats);
+}
+
+/* The per-CPU statistics and histograms are only needed once the device is
+   used. Allocating them in the probe would serialize parallel probes on the
+   per-CPU allocator */
+static int pcd_counters_init(struct pcdev_private_data *dev_data)
+{
+    struct pcd_stats __percpu *stats;
+    struct pcd_latency __percpu *latency;
+    int ret = 0;
+    int cpu;
+
+    if (smp_load_acquire(&dev_data->counters_ready))
+    {
+        return 0;
+    }
+
+    mutex_lock(&pcd_counters_lock);
+    if (dev_data->counters_ready)
+    {
+        goto out;
+    }
+
+    stats = alloc_percpu(struct pcd_stats);
+    latency = alloc_percpu(struct pcd_latency);
+    if (!stats || !latency)
+    {
+        free_percpu(stats);
+        free_percpu(latency);
+        ret = -ENOMEM;
+        goto out;
+    }
+
+    for_each_possible_cpu(cpu)
+    {
+        u64_stats_init(&per_cpu_ptr(stats, cpu)->syncp);
+    }
+
+    dev_data->stats = stats;
+    dev_data->latency = latency;
+    /* the counters must be visible before the flag */
+    smp_store_release(&dev_data->counters_ready, true);
+
+out:
+    mutex_unlock(&pcd_counters_lock);
+    return ret;
+}
+
+/* Releases the counters, see pcd_dev_release() */
+static void pcd_counters_free(struct pcdev_private_data *dev_data)
+{
+    free_percpu(dev_data->stats);
+    free_percpu(dev_data->latency);
+}
+
+/* Sums up the counters of all CPUs */
+static void pcd_stats_sum(struct pcdev_private_data *dev_data, struct pcd_stats *sum)
+{
+    struct pcd_stats *stats;
+    struct pcd_stats snap;
+    unsigned int start;
+    int cpu;
+
+    memset(sum, 0, sizeof(*sum));
+
+    /* never opened */
+    if (!smp_load_acquire(&dev_data->counters_ready))
+    {
+        return;
+    }
+
+    for_each_possible_cpu(cpu)
+    {
+        stats = per_cpu_ptr(dev_data->stats, cpu);
+        do
+        {
+            start = u64_stats_fetch_begin(&stats->syncp);
+            snap = *stats;
+        } while (u64_stats_fetch_retry(&stats->syncp, start));
+
+        sum->bytes_read += snap.bytes_read;
+        sum->bytes_written += snap.bytes_written;
+        sum->reads += snap.reads;
+        sum->writes += snap.writes;
+        sum->opens += snap.opens;
+        sum->releases += snap.releases;
+        sum->efault += snap.efault;
+        sum->enomem += snap.enomem;
+    }
+}
+
+/* Room for the formatted statistics */
+#define PCD_STATS_BUF_SIZE 512
+
+/* Formats the statistics, one "name value" pair per line */
+static int pcd_stats_format(struct pcdev_private_data *dev_data, char *buf, size_t size)
+{
+    struct pcd_stats sum;
+
+    pcd_stats_sum(dev_data, &sum);
+
+    return scnprintf(buf, size,
+        "bytes_read %llu\n"
+        "bytes_written %llu\n"
+        "reads %llu\n"
+        "writes %llu\n"
+        "opens %llu\n"
+        "open_files %llu\n"
+        "efault %llu\n"
+        "enomem %llu\n"
+        "resident_pages %ld\n"
+        "snapshot_pages %ld\n",
+        sum.bytes_read, sum.bytes_written, sum.reads, sum.writes,
+        sum.opens, sum.opens - sum.releases, sum.efault, sum.enomem,
+        atomic_long_read(&dev_data->nr_pages),
+        atomic_long_read(&dev_data->nr_snap_pages));
+}
+
+/* /sys/class/pcd_class/pcdev-N/stats */
+static ssize_t stats_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+    char stats[PCD_STATS_BUF_SIZE];
+
+    pcd_stats_format(dev_get_drvdata(dev), stats, sizeof(stats));
+    return sysfs_emit(buf, "%s", stats);
+}
+static DEVICE_ATTR_RO(stats);
+
+/* /sys/class/pcd_class/pcdev-N/size, writing it resizes the device */
+static ssize_t size_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+    struct pcdev_private_data *dev_data = dev_get_drvdata(dev);
+
+    return sysfs_emit(buf, "%llu\n", READ_ONCE(dev_data->pdata.size));
+}
+
+static ssize_t size_store(struct device *dev, struct device_attribute *attr, const char *buf, size_t count)
+{
+    u64 size;
+    long ret;
+
+    ret = kstrtou64(buf, 0, &size);
+    if (ret)
+    {
+        return ret;
+    }
+
+    ret = pcd_resize(dev_get_drvdata(dev), size);
+    return ret ? ret : count;
+}
+static DEVICE_ATTR_RW(size);
+
+/* /sys/class/pcd_class/pcdev-N/compression, see pcd_zstore_attach(). The
+   ratio is the data held in compressed pages per byte of memory they take,
+   the CPU cost is the time spent in the compressor */
+static ssize_t compression_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+    struct pcdev_private_data *dev_data = dev_get_drvdata(dev);
+    struct pcd_zstore *zs = dev_data->zstore;
+    long nr_zpages;
+    long mem_bytes;
+    unsigned int ratio;
+
+    if (!zs)
+    {
+        return sysfs_emit(buf, "compressor none\n");
+    }
+
+    nr_zpages = atomic_long_read(&zs->nr_zpages);
+    mem_bytes = atomic_long_read(&zs->mem_bytes);
+    ratio = mem_bytes > 0 ? div64_u64((u64)nr_zpages * PAGE_SIZE * 100, mem_bytes) : 0;
+
+    return sysfs_emit(buf,
+        "compressor %s\n"
+        "compressed_pages %ld\n"
+        "compressed_bytes %ld\n"
+        "memory_bytes %ld\n"
+        "ratio %u.%02u\n"
+        "zero_pages %lld\n"
+        "incompressible %lld\n"
+        "compressions %lld\n"
+        "compress_ns %lld\n"
+        "decompressions %lld\n"
+        "decompress_ns %lld\n",
+        zs->comp->name, nr_zpages, atomic_long_read(&zs->compr_bytes), mem_bytes,
+        ratio / 100, ratio % 100,
+        atomic64_read(&zs->zero_pages), atomic64_read(&zs->incompressible),
+        atomic64_read(&zs->compressions), atomic64_read(&zs->compress_ns),
+        atomic64_read(&zs->decompressions), atomic64_read(&zs->decompress_ns));
+}
+static DEVICE_ATTR_RO(compression);
+
+/* Name of the CRC32C implementation in use, e.g. crc32c-intel */
+static const char *pcd_csum_impl(void)
+{
+#if LINUX_VERSION_CODE < KERNEL_VERSION(6, 14, 0)
+    return crc32c_impl();
+#else
+    /* the CRC library calls the CPU specific code directly */
+    return "crc32c";
+#endif
+}
+
+/* /sys/class/pcd_class/pcdev-N/checksum, see pcd_csum_attach() */
+static ssize_t checksum_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+    struct pcdev_private_data *dev_data = dev_get_drvdata(dev);
+    struct pcd_csum *cs = dev_data->csum;
+
+    if (!cs)
+    {
+        return sysfs_emit(buf, "checksum none\n");
+    }
+
+    return sysfs_emit(buf,
+        "checksum crc32c\n"
+        "implementation %s\n"
+        "errors %lld\n"
+        "last_error_offset %lld\n"
+        "scrubs %lld\n"
+        "scrubbed_pages %lld\n"
+        "scrub_ns %lld\n",
+        pcd_csum_impl(), atomic64_read(&cs->errors), atomic64_read(&cs->last_error),
+        atomic64_read(&cs->scrubs), atomic64_read(&cs->scrubbed_pages),
+        atomic64_read(&cs->scrub_ns));
+}
+static DEVICE_ATTR_RO(checksum);
+
+static struct attribute *pcd_dev_attrs[] = {
+    &dev_attr_stats.attr,
+    &dev_attr_size.attr,
+    &dev_attr_compression.attr,
+    &dev_attr_checksum.attr,
+    NULL
+};
+ATTRIBUTE_GROUPS(pcd_dev);
+
+/* <debugfs>/pcd/pcdev-N/stats */
+static int pcd_debugfs_stats_show(struct seq_file *s, void *unused)
+{
+    char buf[PCD_STATS_BUF_SIZE];
+
+    pcd_stats_format(s->private, buf, sizeof(buf));
+    seq_puts(s, buf);
+    return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(pcd_debugfs_stats);
+
+/* Records the latency of an operation started at @start (ktime_get_ns) */
+static void pcd_latency_account(struct pcdev_private_data *dev_data, enum pcd_lat_op op, u64 start)
+{
+    u64 ns = ktime_get_ns() - start;
+    unsigned int bucket = min_t(unsigned int, fls64(ns), PCD_LAT_BUCKETS - 1);
+
+    this_cpu_inc(dev_data->latency->buckets[op][bucket]);
+}
+
+/* Sums up the histogram of an operation over all CPUs, returns the sample count */
+static u64 pcd_latency_sum(struct pcdev_private_data *dev_data, enum pcd_lat_op op, u64 *buckets)
+{
+    u64 total = 0;
+    int cpu, i;
+
+    memset(buckets, 0, sizeof(*buckets) * PCD_LAT_BUCKETS);
+
+    if (!smp_load_acquire(&dev_data->counters_ready))
+    {
+        return 0;
+    }
+
+    for_each_possible_cpu(cpu)
+    {
+        struct pcd_latency *latency = per_cpu_ptr(dev_data->latency, cpu);
+
+        for (i = 0; i < PCD_LAT_BUCKETS; i++)
+        {
+            buckets[i] += READ_ONCE(latency->buckets[op][i]);
+        }
+    }
+
+    for (i = 0; i < PCD_LAT_BUCKETS; i++)
+    {
+        total += buckets[i];
+    }
+
+    return total;
+}
+
+/* Upper bound in ns of the bucket holding the given per mille of the samples */
+static u64 pcd_latency_percentile(const u64 *buckets, u64 total, unsigned int per_mille)
+{
+    u64 count = 0;
+    int i;
+
+    for (i = 0; i < PCD_LAT_BUCKETS - 1; i++)
+    {
+        count += buckets[i];
+        if (count * 1000 >= total * per_mille)
+        {
+            break;
+        }
+    }
+
+    return 1ULL << i;
+}
+
+/* <debugfs>/pcd/pcdev-N/latency, writing anything to the file resets the histograms */
+static int pcd_debugfs_latency_show(struct seq_file *s, void *unused)
+{
+    static const char * const names[PCD_LAT_NR_OPS] = {
+        [PCD_LAT_OPEN] = "open",
+        [PCD_LAT_READ] = "read",
+        [PCD_LAT_WRITE] = "write",
+        [PCD_LAT_LSEEK] = "lseek",
+    };
+    struct pcdev_private_data *dev_data = s->private;
+    u64 buckets[PCD_LAT_BUCKETS];
+    u64 total;
+    int op, i;
+
+    for (op = 0; op < PCD_LAT_NR_OPS; op++)
+    {
+        total = pcd_latency_sum(dev_data, op, buckets);
+        seq_printf(s, "%s: samples %llu", names[op], total);
+        if (total)
+        {
+            seq_printf(s, " p50 < %llu ns p99 < %llu ns p999 < %llu ns",
+                       pcd_latency_percentile(buckets, total, 500),
+                       pcd_latency_percentile(buckets, total, 990),
+                       pcd_latency_percentile(buckets, total, 999));
+        }
+        seq_putc(s, '\n');
+
+        for (i = 0; i < PCD_LAT_BUCKETS; i++)
+        {
+            if (buckets[i])
+            {
+                seq_printf(s, "  < %llu ns: %llu\n", 1ULL << i, buckets[i]);
+            }
+        }
+    }
+
+    return 0;
+}
+
+static int pcd_debugfs_latency_open(struct inode *inode, struct file *file)
+{
+    return single_open(file, pcd_debugfs_latency_show, inode->i_private);
+}
+
+static ssize_t pcd_debugfs_latency_write(struct file *file, const char __user *buf, size_t count, loff_t *ppos)
+{
+    struct pcdev_private_data *dev_data = ((struct seq_file *)file->private_data)->private;
+    int cpu;
+
+    if (!smp_load_acquire(&dev_data->counters_ready))
+    {
+        return count;
+    }
+
+    /* counts updated concurrently with the reset may survive it */
+    for_each_possible_cpu(cpu)
+    {
+        memset(per_cpu_ptr(dev_data->latency, cpu), 0, sizeof(struct pcd_latency));
+    }
+
+    return count;
+}
+
+static const struct file_operations pcd_debugfs_latency_fops = {
+    .owner = THIS_MODULE,
+    .open = pcd_debugfs_latency_open,
+    .read = seq_read,
+    .write = pcd_debugfs_latency_write,
+    .llseek = seq_lseek,
+    .release = single_release,
+};
+
+static loff_t pcd_do_lseek(struct file *filp, loff_t offset, int whence)
+{
+    struct pcdev_private_data *dev_data = filp->private_data;
+    loff_t max_size = READ_ONCE(dev_data->pdata.size);
+    loff_t tmp;
+    unsigned int slot;
+
+    switch(whence)
+    {
+        case SEEK_SET:
+            tmp = offset;
+            break;
+        case SEEK_CUR:
+            tmp = filp->f_pos + offset;
+            break;
+        case SEEK_END:
+            tmp = max_size + offset;
+            break;
+        case SEEK_DATA:
+        case SEEK_HOLE:
+            /* skip over holes (or data) of the sparse storage */
+            if (offset < 0 || offset >= max_size)
+            {
+                return -ENXIO;
+            }
+            slot = pcd_down_read(&dev_data->lock);
+            tmp = pcd_storage_seek(dev_data, offset, whence == SEEK_DATA);
+            pcd_up_read(&dev_data->lock, slot);
+            if (tmp < 0)
+            {
+                return tmp;
+            }
+            break;
+        default:
+            return -EINVAL;
+    }
+
+    if (tmp > max_size || tmp < 0)
+    {
+        return -EINVAL;
+    }
+
+    filp->f_pos = tmp;
+    return filp->f_pos;
+}
+
+static loff_t pcd_lseek(struct file *filp, loff_t offset, int whence)
+{
+    u64 start = ktime_get_ns();
+    loff_t ret;
+
+    ret = pcd_do_lseek(filp, offset, whence);
+
+    pcd_latency_account(filp->private_data, PCD_LAT_LSEEK, start);
+    return ret;
+}
+
+static bool pcd_fifo_nonblock(struct kiocb *iocb)
+{
+    return (iocb->ki_filp->f_flags & O_NONBLOCK) || (iocb->ki_flags & IOCB_NOWAIT);
+}
+
+/* There is data to read (want_data) or free space to write */
+static bool pcd_fifo_ready(struct pcdev_private_data *dev_data, bool want_data)
+{
+    unsigned long used = READ_ONCE(dev_data->fifo_used);
+
+    return want_data ? used : used < dev_data->pdata.size;
+}
+
+/* Takes the FIFO lock once the FIFO is ready, sleeps until then */
+static int pcd_fifo_lock(struct kiocb *iocb, bool want_data)
+{
+    struct pcdev_private_data *dev_data = iocb->ki_filp->private_data;
+    wait_queue_head_t *wq = want_data ? &dev_data->fifo_readq : &dev_data->fifo_writeq;
+
+    if (pcd_fifo_nonblock(iocb))
+    {
+        if (!mutex_trylock(&dev_data->fifo_lock))
+        {
+            return -EAGAIN;
+        }
+    }
+    else if (mutex_lock_interruptible(&dev_data->fifo_lock))
+    {
+        return -ERESTARTSYS;
+    }
+
+    while (!pcd_fifo_ready(dev_data, want_data))
+    {
+        mutex_unlock(&dev_data->fifo_lock);
+
+        if (pcd_fifo_nonblock(iocb))
+        {
+            return -EAGAIN;
+        }
+
+        if (wait_event_interruptible(*wq, pcd_fifo_ready(dev_data, want_data)))
+        {
+            return -ERESTARTSYS;
+        }
+
+        if (mutex_lock_interruptible(&dev_data->fifo_lock))
+        {
+            return -ERESTARTSYS;
+        }
+    }
+
+    return 0;
+}
+
+/* FIFO mode read: sleeps until data arrives, then consumes it */
+static ssize_t pcd_fifo_read_iter(struct kiocb *iocb, struct iov_iter *to)
+{
+    struct pcdev_private_data *dev_data = iocb->ki_filp->private_data;
+    unsigned long size = dev_data->pdata.size;
+    size_t count = iov_iter_count(to);
+    size_t chunk;
+    ssize_t copied;
+    ssize_t ret;
+
+    if (!count)
+    {
+        return 0;
+    }
+
+    ret = pcd_fifo_lock(iocb, true);
+    if (ret)
+    {
+        return ret;
+    }
+
+    count = min_t(size_t, count, dev_data->fifo_used);
+
+    /* the data may wrap around the end of the buffer */
+    chunk = min_t(size_t, count, size - dev_data->fifo_tail);
+    copied = pcd_storage_read(dev_data, dev_data->fifo_tail, chunk, to);
+    if (copied == chunk && chunk < count)
+    {
+        ret = pcd_storage_read(dev_data, 0, count - chunk, to);
+        if (ret > 0)
+        {
+            copied += ret;
+        }
+    }
+
+    if (copied <= 0)
+    {
+        mutex_unlock(&dev_data->fifo_lock);
+        return copied;
+    }
+
+    dev_data->fifo_tail = (dev_data->fifo_tail + copied) % size;
+    WRITE_ONCE(dev_data->fifo_used, dev_data->fifo_used - copied);
+    mutex_unlock(&dev_data->fifo_lock);
+
+    /* space was freed, let the writers in */
+    if (wq_has_sleeper(&dev_data->fifo_writeq))
+    {
+        wake_up_interruptible_poll(&dev_data->fifo_writeq, EPOLLOUT | EPOLLWRNORM);
+    }
+
+    return copied;
+}
+
+/* FIFO mode write: sleeps until there is free space, then appends */
+static ssize_t pcd_fifo_write_iter(struct kiocb *iocb, struct iov_iter *from)
+{
+    struct pcdev_private_data *dev_data = iocb->ki_filp->private_data;
+    unsigned long size = dev_data->pdata.size;
+    size_t count = iov_iter_count(from);
+    size_t chunk;
+    ssize_t copied;
+    ssize_t ret;
+
+    if (!count)
+    {
+        return 0;
+    }
+
+    ret = pcd_fifo_lock(iocb, false);
+    if (ret)
+    {
+        return ret;
+    }
+
+    count = min_t(size_t, count, size - dev_data->fifo_used);
+
+    /* the free space may wrap around the end of the buffer */
+    chunk = min_t(size_t, count, size - dev_data->fifo_head);
+    copied = pcd_storage_write(dev_data, dev_data->fifo_head, chunk, from);
+    if (copied == chunk && chunk < count)
+    {
+        ret = pcd_storage_write(dev_data, 0, count - chunk, from);
+        if (ret > 0)
+        {
+            copied += ret;
+        }
+    }
+
+    if (copied <= 0)
+    {
+        mutex_unlock(&dev_data->fifo_lock);
+        return copied;
+    }
+
+    dev_data->fifo_head = (dev_data->fifo_head + copied) % size;
+    WRITE_ONCE(dev_data->fifo_used, dev_data->fifo_used + copied);
+    mutex_unlock(&dev_data->fifo_lock);
+
+    /* data arrived, wake up the readers */
+    if (wq_has_sleeper(&dev_data->fifo_readq))
+    {
+        wake_up_interruptible_poll(&dev_data->fifo_readq, EPOLLIN | EPOLLRDNORM);
+    }
+
+    return copied;
+}
+
+static __poll_t pcd_poll(struct file *filp, poll_table *wait)
+{
+    struct pcdev_private_data *dev_data = filp->private_data;
+    unsigned long size = dev_data->pdata.size;
+    unsigned long used;
+    __poll_t mask = 0;
+
+    /* a memory device is always ready */
+    if (dev_data->pdata.mode != PCD_MODE_FIFO)
+    {
+        return EPOLLIN | EPOLLRDNORM | EPOLLOUT | EPOLLWRNORM;
+    }
+
+    poll_wait(filp, &dev_data->fifo_readq, wait);
+    poll_wait(filp, &dev_data->fifo_writeq, wait);
+
+    used = READ_ONCE(dev_data->fifo_used);
+    if (used)
+    {
+        mask |= EPOLLIN | EPOLLRDNORM;
+    }
+    if (used < size)
+    {
+        mask |= EPOLLOUT | EPOLLWRNORM;
+    }
+
+    return mask;
+}
+
+/* Random access read of the device memory */
+static ssize_t pcd_linear_read_iter(struct kiocb *iocb, struct iov_iter *to)
+{
+    struct pcdev_private_data *dev_data = iocb->ki_filp->private_data;
+    loff_t max_size;
+    loff_t pos = iocb->ki_pos;
+    size_t count = iov_iter_count(to);
+    ssize_t copied = 0;
+    unsigned int slot;
+
+    /* Nowait requests (RWF_NOWAIT, inline io_uring submissions) must not
+       sleep on the lock, the caller retries them from a blocking context */
+    if (iocb->ki_flags & IOCB_NOWAIT)
+    {
+        if (!pcd_down_read_trylock(&dev_data->lock, &slot))
+        {
+            return -EAGAIN;
+        }
+    }
+    else
+    {
+        slot = pcd_down_read(&dev_data->lock);
+    }
+
+    /* the size is stable only under the lock, see pcd_resize() */
+    max_size = dev_data->pdata.size;
+    if (pos < max_size)
+    {
+        if ((pos + count) > max_size)
+        {
+            count = max_size - pos;
+        }
+        copied = pcd_storage_read(dev_data, pos, count, to);
+    }
+    pcd_up_read(&dev_data->lock, slot);
+
+    if (copied > 0)
+    {
+        iocb->ki_pos += copied;
+    }
+    return copied;
+}
+
+/* Random access write of the device memory */
+static ssize_t pcd_linear_write_iter(struct kiocb *iocb, struct iov_iter *from)
+{
+    struct pcdev_private_data *dev_data = iocb->ki_filp->private_data;
+    loff_t max_size;
+    loff_t pos = iocb->ki_pos;
+    size_t count = iov_iter_count(from);
+    ssize_t copied;
+
+    /* Nowait requests must not sleep on the lock, see pcd_linear_read_iter() */
+    if (iocb->ki_flags & IOCB_NOWAIT)
+    {
+        if (!pcd_down_write_trylock(&dev_data->lock))
+        {
+            return -EAGAIN;
+        }
+    }
+    else
+    {
+        pcd_down_write(&dev_data->lock);
+    }
+
+    /* the size is stable only under the lock, see pcd_resize() */
+    max_size = dev_data->pdata.size;
+    if (pos >= max_size)
+    {
+        count = 0;
+    }
+    else if ((pos + count) > max_size)
+    {
+        count = max_size - pos;
+    }
+
+    copied = count ? pcd_storage_write(dev_data, pos, count, from) : -ENOMEM;
+    pcd_up_write(&dev_data->lock);
+
+    if (copied > 0)
+    {
+        iocb->ki_pos += copied;
+    }
+    return copied;
+}
+
+/* read(), readv(), preadv2() and io_uring reads all end up here. Every segment
+   of a vectored request is served within this single call */
+static ssize_t pcd_read_iter(struct kiocb *iocb, struct iov_iter *to)
+{
+    struct pcdev_private_data *dev_data = iocb->ki_filp->private_data;
+    u64 start = ktime_get_ns();
+    ssize_t ret;
+
+    if (dev_data->pdata.mode == PCD_MODE_FIFO)
+    {
+        ret = pcd_fifo_read_iter(iocb, to);
+    }
+    else
+    {
+        ret = pcd_linear_read_iter(iocb, to);
+    }
+
+    pcd_stats_account(dev_data, PCD_STAT_READ, ret);
+    pcd_latency_account(dev_data, PCD_LAT_READ, start);
+    return ret;
+}
+
+static ssize_t pcd_write_iter(struct kiocb *iocb, struct iov_iter *from)
+{
+    struct pcdev_private_data *dev_data = iocb->ki_filp->private_data;
+    u64 start = ktime_get_ns();
+    ssize_t ret;
+
+    if (dev_data->pdata.mode == PCD_MODE_FIFO)
+    {
+        ret = pcd_fifo_write_iter(iocb, from);
+    }
+    else
+    {
+        ret = pcd_linear_write_iter(iocb, from);
+    }
+
+    pcd_stats_account(dev_data, PCD_STAT_WRITE, ret);
+    pcd_latency_account(dev_data, PCD_LAT_WRITE, start);
+    return ret;
+}
+
+/* Executes one read or write descriptor of a batch or a ring, the device
+   lock is held by the caller */
+static ssize_t pcd_batch_one(struct file *filp, struct pcd_io_vec *vec)
+{
+    struct pcdev_private_data *dev_data = filp->private_data;
+    bool write = vec->dir == PCD_IO_WRITE;
+    u64 max_size = dev_data->pdata.size;
+    size_t count = vec->len;
+    struct iov_iter iter;
+#if LINUX_VERSION_CODE < KERNEL_VERSION(6, 7, 0)
+    struct iovec iov;
+#endif
+    ssize_t ret;
+
+    if (vec->dir != PCD_IO_READ && vec->dir != PCD_IO_WRITE)
+    {
+        return -EINVAL;
+    }
+
+    if (!(filp->f_mode & (write ? FMODE_WRITE : FMODE_READ)))
+    {
+        return -EBADF;
+    }
+
+    /* same end of device rules as read() and write() */
+    if (vec->offset >= max_size)
+    {
+        return write ? -ENOMEM : 0;
+    }
+
+    if (vec->len > max_size - vec->offset)
+    {
+        count = max_size - vec->offset;
+    }
+
+    /* the result has to fit in 32 bits */
+    count = min_t(size_t, count, MAX_RW_COUNT);
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 7, 0)
+    ret = import_ubuf(write ? ITER_SOURCE : ITER_DEST, u64_to_user_ptr(vec->buf), count, &iter);
+#else
+    ret = import_single_range(write ? WRITE : READ, u64_to_user_ptr(vec->buf), count, &iov, &iter);
+#endif
+    if (ret)
+    {
+        return ret;
+    }
+
+    if (write)
+    {
+        return pcd_storage_write(dev_data, vec->offset, count, &iter);
+    }
+    return pcd_storage_read(dev_data, vec->offset, count, &iter);
+}
+
+/* PCD_IOC_BATCH, many small reads and writes for the price of one syscall
+   and one lock round trip */
+static long pcd_batch(struct file *filp, struct pcd_io_batch __user *ubatch)
+{
+    struct pcdev_private_data *dev_data = filp->private_data;
+    struct pcd_io_batch batch;
+    struct pcd_io_vec *vecs;
+    bool writes = false;
+    long ret = 0;
+    u32 i;
+    unsigned int slot = 0;
+
+    if (dev_data->pdata.mode == PCD_MODE_FIFO)
+    {
+        return -EINVAL;
+    }
+
+    if (copy_from_user(&batch, ubatch, sizeof(batch)))
+    {
+        return -EFAULT;
+    }
+
+    if (batch.flags || batch.count > PCD_IO_BATCH_MAX)
+    {
+        return -EINVAL;
+    }
+
+    if (!batch.count)
+    {
+        return 0;
+    }
+
+    vecs = memdup_user(u64_to_user_ptr(batch.vecs), batch.count * sizeof(*vecs));
+    if (IS_ERR(vecs))
+    {
+        return PTR_ERR(vecs);
+    }
+
+    for (i = 0; i < batch.count; i++)
+    {
+        writes |= vecs[i].dir == PCD_IO_WRITE;
+    }
+
+    /* read only batches run concurrently with each other */
+    if (writes)
+    {
+        pcd_down_write(&dev_data->lock);
+    }
+    else
+    {
+        slot = pcd_down_read(&dev_data->lock);
+    }
+
+    for (i = 0; i < batch.count; i++)
+    {
+        ssize_t result = pcd_batch_one(filp, &vecs[i]);
+
+        vecs[i].result = result;
+        pcd_stats_account(dev_data, vecs[i].dir == PCD_IO_WRITE ? PCD_STAT_WRITE : PCD_STAT_READ, result);
+    }
+
+    if (writes)
+    {
+        pcd_up_write(&dev_data->lock);
+    }
+    else
+    {
+        pcd_up_read(&dev_data->lock, slot);
+    }
+
+    if (copy_to_user(u64_to_user_ptr(batch.vecs), vecs, batch.count * sizeof(*vecs)))
+    {
+        ret = -EFAULT;
+    }
+
+    kfree(vecs);
+    return ret;
+}
+
+/* State of a submission/completion ring pair */
+struct pcd_ring_ctx
+{
+    struct file *file;          /* the device file the ring was set up on */
+    struct pcdev_private_data *dev_data;
+    struct mm_struct *mm;       /* address space of the user buffers */
+    struct task_struct *thread;
+    void *ring;                 /* memory shared with user space */
+    size_t ring_size;
+    struct pcd_ring_ctrl *sq;
+    struct pcd_ring_ctrl *cq;
+    struct pcd_sqe *sqes;
+    struct pcd_cqe *cqes;
+    u32 sq_head;                /* private copies, user space may scribble */
+    u32 cq_tail;                /* over the shared ones */
+    u32 sq_entries;
+    u32 cq_entries;
+    unsigned long idle;         /* jiffies to keep polling an empty SQ */
+    wait_queue_head_t cq_wait;
+};
+
+/* Executes one submission in the context of the ring thread */
+static ssize_t pcd_ring_exec(struct pcd_ring_ctx *ctx, const struct pcd_sqe *sqe)
+{
+    struct pcdev_private_data *dev_data = ctx->dev_data;
+    struct pcd_io_vec vec;
+    ssize_t ret;
+    unsigned int slot;
+
+    switch (sqe->opcode)
+    {
+        case PCD_OP_NOP:
+            return 0;
+        case PCD_OP_READ:
+        case PCD_OP_WRITE:
+            vec.offset = sqe->off;
+            vec.len = sqe->len;
+            vec.buf = sqe->addr;
+            vec.dir = sqe->opcode == PCD_OP_WRITE ? PCD_IO_WRITE : PCD_IO_READ;
+
+            if (vec.dir == PCD_IO_WRITE)
+            {
+                pcd_down_write(&dev_data->lock);
+                ret = pcd_batch_one(ctx->file, &vec);
+                pcd_up_write(&dev_data->lock);
+                pcd_stats_account(dev_data, PCD_STAT_WRITE, ret);
+            }
+            else
+            {
+                slot = pcd_down_read(&dev_data->lock);
+                ret = pcd_batch_one(ctx->file, &vec);
+                pcd_up_read(&dev_data->lock, slot);
+                pcd_stats_account(dev_data, PCD_STAT_READ, ret);
+            }
+            return ret;
+        case PCD_OP_COPY:
+            if ((ctx->file->f_mode & (FMODE_READ | FMODE_WRITE)) != (FMODE_READ | FMODE_WRITE))
+            {
+                return -EBADF;
+            }
+            pcd_down_write(&dev_data->lock);
+            ret = pcd_copy_range(dev_data, sqe->off, dev_data, sqe->addr, sqe->len);
+            pcd_up_write(&dev_data->lock);
+            return ret;
+        default:
+            return -EINVAL;
+    }
+}
+
+/* Submissions that can be taken right now */
+static bool pcd_ring_pending(struct pcd_ring_ctx *ctx)
+{
+    return smp_load_acquire(&ctx->sq->tail) != ctx->sq_head &&
+           ctx->cq_tail - smp_load_acquire(&ctx->cq->head) < ctx->cq_entries;
+}
+
+/* Completions user space has not consumed yet */
+static u32 pcd_ring_cq_ready(struct pcd_ring_ctx *ctx)
+{
+    return READ_ONCE(ctx->cq->tail) - READ_ONCE(ctx->cq->head);
+}
+
+/* Executes the submissions posted so far, returns how many were executed */
+static u32 pcd_ring_work(struct pcd_ring_ctx *ctx)
+{
+    u32 head = ctx->sq_head;
+    u32 tail = smp_load_acquire(&ctx->sq->tail);
+    u32 done = 0;
+
+    if (head == tail)
+    {
+        return 0;
+    }
+
+    if (tail - head > ctx->sq_entries)
+    {
+        tail = head + ctx->sq_entries;
+    }
+
+    /* the owner has exited, nobody is going to look at the completions */
+    if (!mmget_not_zero(ctx->mm))
+    {
+        return 0;
+    }
+    kthread_use_mm(ctx->mm);
+
+    while (head != tail && ctx->cq_tail - smp_load_acquire(&ctx->cq->head) < ctx->cq_entries)
+    {
+        struct pcd_cqe *cqe = &ctx->cqes[ctx->cq_tail & (ctx->cq_entries - 1)];
+        struct pcd_sqe sqe;
+
+        /* user space may still change the entry, work on a copy */
+        memcpy(&sqe, &ctx->sqes[head & (ctx->sq_entries - 1)], sizeof(sqe));
+        smp_store_release(&ctx->sq->head, ++head);
+
+        cqe->user_data = sqe.user_data;
+        cqe->res = pcd_ring_exec(ctx, &sqe);
+        cqe->flags = 0;
+        smp_store_release(&ctx->cq->tail, ++ctx->cq_tail);
+        done++;
+    }
+
+    kthread_unuse_mm(ctx->mm);
+    mmput(ctx->mm);
+
+    ctx->sq_head = head;
+
+    if (done && wq_has_sleeper(&ctx->cq_wait))
+    {
+        wake_up_interruptible_poll(&ctx->cq_wait, EPOLLIN | EPOLLRDNORM);
+    }
+    return done;
+}
+
+static int pcd_ring_thread(void *data)
+{
+    struct pcd_ring_ctx *ctx = data;
+    unsigned long timeout = jiffies + ctx->idle;
+
+    while (!kthread_should_stop())
+    {
+        if (pcd_ring_work(ctx))
+        {
+            timeout = jiffies + ctx->idle;
+            cond_resched();
+            continue;
+        }
+
+        /* SQPOLL, keep spinning on the SQ for a while */
+        if (time_before(jiffies, timeout))
+        {
+            cond_resched();
+            continue;
+        }
+
+        set_current_state(TASK_INTERRUPTIBLE);
+        WRITE_ONCE(ctx->sq->flags, READ_ONCE(ctx->sq->flags) | PCD_RING_NEED_WAKEUP);
+        /* pairs with the barrier between the tail update and the flag check in user space */
+        smp_mb();
+
+        if (pcd_ring_pending(ctx) || kthread_should_stop())
+        {
+            __set_current_state(TASK_RUNNING);
+        }
+        else
+        {
+            schedule();
+        }
+
+        WRITE_ONCE(ctx->sq->flags, READ_ONCE(ctx->sq->flags) & ~PCD_RING_NEED_WAKEUP);
+        timeout = jiffies + ctx->idle;
+    }
+
+    return 0;
+}
+
+static int pcd_ring_mmap(struct file *filp, struct vm_area_struct *vma)
+{
+    struct pcd_ring_ctx *ctx = filp->private_data;
+
+    if (vma->vm_pgoff)
+    {
+        return -EINVAL;
+    }
+
+    return remap_vmalloc_range(vma, ctx->ring, 0);
+}
+
+static __poll_t pcd_ring_poll(struct file *filp, struct poll_table_struct *wait)
+{
+    struct pcd_ring_ctx *ctx = filp->private_data;
+
+    poll_wait(filp, &ctx->cq_wait, wait);
+
+    return pcd_ring_cq_ready(ctx) ? EPOLLIN | EPOLLRDNORM : 0;
+}
+
+static long pcd_ring_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
+{
+    struct pcd_ring_ctx *ctx = filp->private_data;
+    int ret;
+
+    if (cmd != PCD_RING_IOC_ENTER)
+    {
+        return -ENOTTY;
+    }
+
+    if (arg > ctx->cq_entries)
+    {
+        return -EINVAL;
+    }
+
+    wake_up_process(ctx->thread);
+
+    ret = wait_event_interruptible(ctx->cq_wait, pcd_ring_cq_ready(ctx) >= arg);
+    if (ret)
+    {
+        return ret;
+    }
+
+    return pcd_ring_cq_ready(ctx);
+}
+
+static int pcd_ring_release(struct inode *inode, struct file *filp)
+{
+    struct pcd_ring_ctx *ctx = filp->private_data;
+
+    kthread_stop(ctx->thread);
+    mmdrop(ctx->mm);
+    atomic_dec(&ctx->dev_data->nr_rings);
+    fput(ctx->file);
+    vfree(ctx->ring);
+    kfree(ctx);
+
+    return 0;
+}
+
+static const struct file_operations pcd_ring_fops =
+{
+    .mmap = pcd_ring_mmap,
+    .poll = pcd_ring_poll,
+    .unlocked_ioctl = pcd_ring_ioctl,
+    .compat_ioctl = compat_ptr_ioctl,
+    .release = pcd_ring_release,
+    .owner = THIS_MODULE
+};
+
+/* Every ring has a kernel thread, a device gets a limited number of them */
+#define PCD_RING_MAX_PER_DEVICE 16
+
+/* PCD_IOC_RING_SETUP, returns the file descriptor of the new ring */
+static long pcd_ring_setup(struct file *filp, struct pcd_ring_params __user *uparams)
+{
+    struct pcdev_private_data *dev_data = filp->private_data;
+    struct pcd_ring_params params;
+    struct pcd_ring_ctx *ctx;
+    struct file *file;
+    long ret;
+    int fd;
+
+    if (dev_data->pdata.mode == PCD_MODE_FIFO)
+    {
+        return -EINVAL;
+    }
+
+    if (copy_from_user(&params, uparams, sizeof(params)))
+    {
+        return -EFAULT;
+    }
+
+    if (params.flags & ~PCD_RING_SQPOLL)
+    {
+        return -EINVAL;
+    }
+
+    if (!params.sq_entries || params.sq_entries > PCD_RING_MAX_ENTRIES)
+    {
+        return -EINVAL;
+    }
+
+    if (!params.cq_entries)
+    {
+        params.cq_entries = 2 * params.sq_entries;
+    }
+
+    if (params.cq_entries < params.sq_entries || params.cq_entries > 2 * PCD_RING_MAX_ENTRIES)
+    {
+        return -EINVAL;
+    }
+
+    /* a polling thread burns a CPU, like IORING_SETUP_SQPOLL it needs the
+       privilege to take one */
+    if (params.flags & PCD_RING_SQPOLL)
+    {
+        if (params.sq_idle_ms > PCD_RING_MAX_IDLE_MS)
+        {
+            return -EINVAL;
+        }
+        if (!capable(CAP_SYS_NICE))
+        {
+            return -EPERM;
+        }
+    }
+
+    if (atomic_inc_return(&dev_data->nr_rings) > PCD_RING_MAX_PER_DEVICE)
+    {
+        atomic_dec(&dev_data->nr_rings);
+        return -EMFILE;
+    }
+
+    params.sq_entries = roundup_pow_of_two(params.sq_entries);
+    params.cq_entries = roundup_pow_of_two(params.cq_entries);
+    params.sq_off = 2 * sizeof(struct pcd_ring_ctrl);
+    params.cq_off = params.sq_off + params.sq_entries * sizeof(struct pcd_sqe);
+    params.ring_size = params.cq_off + params.cq_entries * sizeof(struct pcd_cqe);
+
+    ctx = kzalloc(sizeof(*ctx), GFP_KERNEL);
+    if (!ctx)
+    {
+        ret = -ENOMEM;
+        goto put_ring;
+    }
+
+    ctx->ring_size = params.ring_size;
+    ctx->ring = vmalloc_user(ctx->ring_size);
+    if (!ctx->ring)
+    {
+        ret = -ENOMEM;
+        goto free_ctx;
+    }
+
+    ctx->sq = ctx->ring;
+    ctx->cq = ctx->ring + sizeof(struct pcd_ring_ctrl);
+    ctx->sqes = ctx->ring + params.sq_off;
+    ctx->cqes = ctx->ring + params.cq_off;
+    ctx->sq_entries = params.sq_entries;
+    ctx->cq_entries = params.cq_entries;
+    ctx->sq->mask = params.sq_entries - 1;
+    ctx->sq->entries = params.sq_entries;
+    ctx->cq->mask = params.cq_entries - 1;
+    ctx->cq->entries = params.cq_entries;
+
+    if (params.flags & PCD_RING_SQPOLL)
+    {
+        ctx->idle = msecs_to_jiffies(params.sq_idle_ms ? params.sq_idle_ms : 1000);
+    }
+
+    init_waitqueue_head(&ctx->cq_wait);
+    ctx->dev_data = dev_data;
+    ctx->mm = current->mm;
+    mmgrab(ctx->mm);
+
+    ctx->thread = kthread_create(pcd_ring_thread, ctx, "pcd_ring-%d", MINOR(dev_data->dev_num));
+    if (IS_ERR(ctx->thread))
+    {
+        ret = PTR_ERR(ctx->thread);
+        goto drop_mm;
+    }
+
+    if (copy_to_user(uparams, &params, sizeof(params)))
+    {
+        ret = -EFAULT;
+        goto stop_thread;
+    }
+
+    fd = get_unused_fd_flags(O_RDWR | O_CLOEXEC);
+    if (fd < 0)
+    {
+        ret = fd;
+        goto stop_thread;
+    }
+
+    file = anon_inode_getfile("[pcd_ring]", &pcd_ring_fops, ctx, O_RDWR);
+    if (IS_ERR(file))
+    {
+        put_unused_fd(fd);
+        ret = PTR_ERR(file);
+        goto stop_thread;
+    }
+
+    /* from now on the ring belongs to its file, which must not become
+       visible before the thread is running */
+    ctx->file = get_file(filp);
+    wake_up_process(ctx->thread);
+    fd_install(fd, file);
+    return fd;
+
+stop_thread:
+    kthread_stop(ctx->thread);
+drop_mm:
+    mmdrop(ctx->mm);
+    vfree(ctx->ring);
+free_ctx:
+    kfree(ctx);
+put_ring:
+    atomic_dec(&dev_data->nr_rings);
+    return ret;
+}
+
+/* Locks two devices for a copy. The locks are always taken in the same
+   order, so copies in opposite directions cannot deadlock. The result is
+   the read slot of the source for pcd_copy_unlock() */
+static unsigned int pcd_copy_lock(struct pcdev_private_data *dst_dev, struct pcdev_private_data *src_dev)
+{
+    unsigned int slot = 0;
+
+    if (dst_dev == src_dev)
+    {
+        pcd_down_write(&dst_dev->lock);
+    }
+    else if (dst_dev < src_dev)
+    {
+        pcd_down_write(&dst_dev->lock);
+        slot = pcd_down_read(&src_dev->lock);
+    }
+    else
+    {
+        slot = pcd_down_read(&src_dev->lock);
+        pcd_down_write(&dst_dev->lock);
+    }
+    return slot;
+}
+
+static void pcd_copy_unlock(struct pcdev_private_data *dst_dev, struct pcdev_private_data *src_dev,
+                     unsigned int slot)
+{
+    if (dst_dev != src_dev)
+    {
+        pcd_up_read(&src_dev->lock, slot);
+    }
+    pcd_up_write(&dst_dev->lock);
+}
+
+/* PCD_IOC_COPY_RANGE, the VFS refuses copy_file_range() on anything but
+   regular files */
+static long pcd_copy_file_range(struct file *dst_filp, struct pcd_copy __user *uarg)
+{
+    struct pcdev_private_data *dst_dev = dst_filp->private_data;
+    struct pcdev_private_data *src_dev;
+    struct pcd_copy args;
+    struct file *src;
+    unsigned int slot;
+    long ret;
+
+    if (copy_from_user(&args, uarg, sizeof(args)))
+    {
+        return -EFAULT;
+    }
+
+    if (!(dst_filp->f_mode & FMODE_WRITE))
+    {
+        return -EBADF;
+    }
+
+    /* struct fd changed in 6.12, a reference of our own works everywhere */
+    src = fget(args.src_fd);
+    if (!src)
+    {
+        return -EBADF;
+    }
+
+    if (src->f_op != &pcd_fops)
+    {
+        ret = -EINVAL;
+        goto out;
+    }
+
+    if (!(src->f_mode & FMODE_READ))
+    {
+        ret = -EBADF;
+        goto out;
+    }
+
+    src_dev = src->private_data;
+    if (src_dev->pdata.mode == PCD_MODE_FIFO || dst_dev->pdata.mode == PCD_MODE_FIFO)
+    {
+        ret = -EINVAL;
+        goto out;
+    }
+
+    slot = pcd_copy_lock(dst_dev, src_dev);
+    ret = pcd_copy_range(dst_dev, args.dst_offset, src_dev, args.src_offset, args.len);
+    pcd_copy_unlock(dst_dev, src_dev, slot);
+
+    pcd_stats_account(src_dev, PCD_STAT_READ, ret);
+    pcd_stats_account(dst_dev, PCD_STAT_WRITE, ret);
+
+out:
+    fput(src);
+    return ret;
+}
+
+/* Reads the snapshot. Pages that were not changed since the snapshot was
+   taken are read from the device */
+static ssize_t pcd_snap_read_iter(struct kiocb *iocb, struct iov_iter *to)
+{
+    struct pcd_snapshot *snap = iocb->ki_filp->private_data;
+    struct pcdev_private_data *dev_data = snap->dev_data;
+    loff_t pos = iocb->ki_pos;
+    size_t count = iov_iter_count(to);
+    size_t done = 0;
+    ssize_t ret = 0;
+    unsigned int slot;
+
+    if (pos >= snap->size)
+    {
+        return 0;
+    }
+    count = min_t(u64, count, snap->size - pos);
+
+    /* keeps discard and shrink from releasing the device pages */
+    if (iocb->ki_flags & IOCB_NOWAIT)
+    {
+        if (!pcd_down_read_trylock(&dev_data->lock, &slot))
+        {
+            return -EAGAIN;
+        }
+    }
+    else
+    {
+        slot = pcd_down_read(&dev_data->lock);
+    }
+
+    while (done < count)
+    {
+        pgoff_t index = (pos + done) >> PAGE_SHIFT;
+        size_t offset = (pos + done) & ~PAGE_MASK;
+        size_t bytes = min_t(size_t, count - done, PAGE_SIZE - offset);
+        size_t copied = 0;
+        void *entry;
+        void *page;
+        void *addr;
+
+        entry = xa_load(&snap->pages, index);
+        if (!entry)
+        {
+            page = pcd_storage_get(dev_data, index);
+            if (IS_ERR(page))
+            {
+                ret = done ? done : PTR_ERR(page);
+                break;
+            }
+            if (page)
+            {
+                addr = pcd_storage_map(dev_data, page);
+                copied = copy_to_iter(addr + offset, bytes, to);
+                pcd_storage_unmap(dev_data, addr);
+            }
+            else
+            {
+                copied = iov_iter_zero(bytes, to);
+            }
+
+            /* Block writes only hold the read side of the lock. One that
+               changed the page meanwhile has preserved it first, the copy
+               is redone from there */
+            smp_rmb();
+            entry = xa_load(&snap->pages, index);
+            if (entry)
+            {
+                iov_iter_revert(to, copied);
+            }
+        }
+
+        if (entry)
+        {
+            copied = xa_is_value(entry) ? iov_iter_zero(bytes, to) : copy_page_to_iter(entry, offset, bytes, to);
+        }
+
+        done += copied;
+        if (copied != bytes)
+        {
+            ret = done ? done : -EFAULT;
+            break;
+        }
+    }
+    pcd_up_read(&dev_data->lock, slot);
+
+    if (!ret)
+    {
+        ret = done;
+    }
+    if (ret > 0)
+    {
+        iocb->ki_pos += ret;
+    }
+    return ret;
+}
+
+static loff_t pcd_snap_llseek(struct file *filp, loff_t offset, int whence)
+{
+    struct pcd_snapshot *snap = filp->private_data;
+
+    return fixed_size_llseek(filp, offset, whence, snap->size);
+}
+
+/* A mapping needs pages that stay as they are, so the snapshot takes its
+   own copy of every page faulted in */
+static vm_fault_t pcd_snap_fault(struct vm_fault *vmf)
+{
+    struct pcd_snapshot *snap = vmf->vma->vm_private_data;
+    struct pcdev_private_data *dev_data = snap->dev_data;
+    struct page *page;
+    void *entry;
+    void *addr;
+    void *src;
+    int ret;
+
+    if (vmf->pgoff > snap->last)
+    {
+        return VM_FAULT_SIGBUS;
+    }
+
+    entry = xa_load(&snap->pages, vmf->pgoff);
+    if (entry && !xa_is_value(entry))
+    {
+        page = entry;
+        goto map;
+    }
+
+    /* Writers preserve the page under the same lock before they change or
+       release it, so the device page is stable while it is not preserved */
+    mutex_lock(&dev_data->cow_lock);
+    entry = xa_load(&snap->pages, vmf->pgoff);
+    if (entry && !xa_is_value(entry))
+    {
+        mutex_unlock(&dev_data->cow_lock);
+        page = entry;
+        goto map;
+    }
+
+    page = alloc_page(GFP_HIGHUSER | __GFP_ZERO);
+    if (!page)
+    {
+        mutex_unlock(&dev_data->cow_lock);
+        return VM_FAULT_OOM;
+    }
+
+    src = entry ? NULL : pcd_storage_get(dev_data, vmf->pgoff);
+    if (IS_ERR(src))
+    {
+        mutex_unlock(&dev_data->cow_lock);
+        __free_page(page);
+        return VM_FAULT_OOM;
+    }
+    if (src)
+    {
+        addr = pcd_storage_map(dev_data, src);
+        memcpy_to_page(page, 0, addr, PAGE_SIZE);
+        pcd_storage_unmap(dev_data, addr);
+    }
+
+    ret = xa_err(xa_store(&snap->pages, vmf->pgoff, page, GFP_KERNEL));
+    if (ret)
+    {
+        mutex_unlock(&dev_data->cow_lock);
+        __free_page(page);
+        return VM_FAULT_OOM;
+    }
+    atomic_long_inc(&dev_data->nr_snap_pages);
+    mutex_unlock(&dev_data->cow_lock);
+
+map:
+    /* the mapping holds its own reference to the page */
+    get_page(page);
+    vmf->page = page;
+    return 0;
+}
+
+static const struct vm_operations_struct pcd_snap_vm_ops = {
+    .fault = pcd_snap_fault
+};
+
+/* Changes the flags of a new mapping, vm_flags is read-only since 6.3 */
+static void pcd_vm_flags_mod(struct vm_area_struct *vma, vm_flags_t set, vm_flags_t clear)
+{
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 3, 0)
+    vm_flags_mod(vma, set, clear);
+#else
+    vma->vm_flags = (vma->vm_flags | set) & ~clear;
+#endif
+}
+
+static int pcd_snap_mmap(struct file *filp, struct vm_area_struct *vma)
+{
+    struct pcd_snapshot *snap = filp->private_data;
+    unsigned long map_size = PAGE_ALIGN(snap->size);
+    unsigned long offset = vma->vm_pgoff << PAGE_SHIFT;
+    unsigned long len = vma->vm_end - vma->vm_start;
+
+    if (vma->vm_flags & VM_WRITE)
+    {
+        return -EACCES;
+    }
+
+    if (offset >= map_size || len > map_size - offset)
+    {
+        return -EINVAL;
+    }
+
+    pcd_vm_flags_mod(vma, VM_DONTEXPAND | VM_DONTDUMP, VM_MAYWRITE);
+    vma->vm_ops = &pcd_snap_vm_ops;
+    vma->vm_private_data = snap;
+    return 0;
+}
+
+/* Detaches a snapshot from its device and releases its pages */
+static void pcd_snapshot_free(struct pcd_snapshot *snap)
+{
+    struct pcdev_private_data *dev_data = snap->dev_data;
+    unsigned long index;
+    void *entry;
+
+    mutex_lock(&dev_data->cow_lock);
+    list_del_rcu(&snap->node);
+    mutex_unlock(&dev_data->cow_lock);
+
+    /* pcd_snap_preserve() looks at the list without the lock */
+    synchronize_rcu();
+
+    xa_for_each(&snap->pages, index, entry)
+    {
+        if (!xa_is_value(entry))
+        {
+            put_page(entry);
+            atomic_long_dec(&dev_data->nr_snap_pages);
+        }
+    }
+    xa_destroy(&snap->pages);
+    kfree(snap);
+}
+
+static int pcd_snap_release(struct inode *inode, struct file *filp)
+{
+    struct pcd_snapshot *snap = filp->private_data;
+    struct file *file = snap->file;
+
+    pcd_snapshot_free(snap);
+    fput(file);
+
+    return 0;
+}
+
+static const struct file_operations pcd_snap_fops =
+{
+    .read_iter = pcd_snap_read_iter,
+    .llseek = pcd_snap_llseek,
+    .mmap = pcd_snap_mmap,
+    .release = pcd_snap_release,
+    .owner = THIS_MODULE
+};
+
+/* PCD_IOC_SNAPSHOT, returns the file descriptor of the new snapshot.
+   Nothing is copied here, the snapshot shares all pages with the device
+   until a writer changes them */
+static long pcd_snapshot_create(struct file *filp)
+{
+    struct pcdev_private_data *dev_data = filp->private_data;
+    struct pcd_snapshot *snap;
+    struct file *file;
+    long ret;
+    int fd;
+
+    if (dev_data->pdata.mode == PCD_MODE_FIFO)
+    {
+        return -EINVAL;
+    }
+
+    if (!(filp->f_mode & FMODE_READ))
+    {
+        return -EBADF;
+    }
+
+    snap = kzalloc(sizeof(*snap), GFP_KERNEL);
+    if (!snap)
+    {
+        return -ENOMEM;
+    }
+
+    xa_init(&snap->pages);
+    snap->dev_data = dev_data;
+
+    /* no writer may be half way through changing a page */
+    pcd_down_write(&dev_data->lock);
+
+    /* writes through an existing mapping could not be preserved */
+    if (atomic_read(&dev_data->nr_mmaps))
+    {
+        pcd_up_write(&dev_data->lock);
+        kfree(snap);
+        return -EBUSY;
+    }
+
+    snap->size = dev_data->pdata.size;
+    snap->last = (snap->size - 1) >> PAGE_SHIFT;
+
+    mutex_lock(&dev_data->cow_lock);
+    list_add_rcu(&snap->node, &dev_data->snapshots);
+    mutex_unlock(&dev_data->cow_lock);
+
+    pcd_up_write(&dev_data->lock);
+
+    fd = get_unused_fd_flags(O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+    {
+        ret = fd;
+        goto free_snap;
+    }
+
+    file = anon_inode_getfile("[pcd_snapshot]", &pcd_snap_fops, snap, O_RDONLY);
+    if (IS_ERR(file))
+    {
+        put_unused_fd(fd);
+        ret = PTR_ERR(file);
+        goto free_snap;
+    }
+
+    /* anonymous files are not seekable by default */
+#ifdef FMODE_LSEEK
+    file->f_mode |= FMODE_LSEEK;
+#endif
+    file->f_mode |= FMODE_PREAD;
+
+    snap->file = get_file(filp);
+    fd_install(fd, file);
+    return fd;
+
+free_snap:
+    pcd_snapshot_free(snap);
+    return ret;
+}
+
+static long pcd_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
+{
+    struct pcdev_private_data *dev_data = filp->private_data;
+    void __user *argp = (void __user *)arg;
+    struct pcd_range range;
+    u64 size;
+
+    switch (cmd)
+    {
+        case PCD_IOC_DISCARD:
+            if (!(filp->f_mode & FMODE_WRITE))
+            {
+                return -EBADF;
+            }
+            if (copy_from_user(&range, argp, sizeof(range)))
+            {
+                return -EFAULT;
+            }
+            return pcd_discard(dev_data, range.offset, range.len);
+        case PCD_IOC_BATCH:
+            return pcd_batch(filp, argp);
+        case PCD_IOC_RING_SETUP:
+            return pcd_ring_setup(filp, argp);
+        case PCD_IOC_COPY_RANGE:
+            return pcd_copy_file_range(filp, argp);
+        case PCD_IOC_RESIZE:
+            if (!(filp->f_mode & FMODE_WRITE))
+            {
+                return -EBADF;
+            }
+            if (copy_from_user(&size, argp, sizeof(size)))
+            {
+                return -EFAULT;
+            }
+            return pcd_resize(dev_data, size);
+        case PCD_IOC_SNAPSHOT:
+            return pcd_snapshot_create(filp);
+        case PCD_IOC_VERIFY:
+            return pcd_verify(filp, argp);
+        default:
+            return -ENOTTY;
+    }
+}
+
+/* Frees the device once the last reference to it is gone. Nobody uses it
+   anymore, but the workers may still be queued */
+static void pcd_dev_release(struct kref *ref)
+{
+    struct pcdev_private_data *dev_data = container_of(ref, struct pcdev_private_data, ref);
+
+    if (dev_data->zstore)
+    {
+        pcd_zstore_detach(dev_data->zstore);
+    }
+    if (dev_data->csum)
+    {
+        pcd_csum_detach(dev_data->csum);
+    }
+    if (dev_data->backing)
+    {
+        pcd_persist_detach(dev_data);
+    }
+    pcd_counters_free(dev_data);
+    pcd_storage_free(dev_data);
+    if (dev_data->mem)
+    {
+        memunmap(dev_data->mem);
+    }
+    kfree_const(dev_data->pdata.compressor);
+    kfree_const(dev_data->pdata.backing_file);
+    kfree_const(dev_data->pdata.serial_number);
+    kfree(dev_data);
+}
+
+/* Also the devm action dropping the reference of the device itself */
+static void pcd_dev_put(void *data)
+{
+    struct pcdev_private_data *dev_data = data;
+
+    kref_put(&dev_data->ref, pcd_dev_release);
+}
+
+/* Takes a reference to the device of a char device inode, NULL once the
+   device is removed */
+static struct pcdev_private_data *pcd_dev_get(struct inode *inode)
+{
+    struct pcdev_private_data *dev_data;
+
+    xa_lock(&pcd_minors);
+    dev_data = xa_load(&pcd_minors, MINOR(inode->i_rdev) - MINOR(pcdrv_data.device_num_base));
+    /* the minor may belong to a newer device than the inode */
+    if (dev_data && dev_data->cdev == inode->i_cdev)
+    {
+        kref_get(&dev_data->ref);
+    }
+    else
+    {
+        dev_data = NULL;
+    }
+    xa_unlock(&pcd_minors);
+
+    return dev_data;
+}
+
+static int check_permission(int dev_perm, int acc_mode)
+{
+    if (dev_perm == RDWR)
+    {
+        return 0;
+    }
+    if ( (dev_perm == RDONLY) && ( (acc_mode & FMODE_READ) && !(acc_mode & FMODE_WRITE)) )
+    {
+        return 0;
+    }
+    if ( (dev_perm == WRONLY) && ( !(acc_mode & FMODE_READ) && (acc_mode & FMODE_WRITE)) )
+    {
+        return 0;
+    }
+
+    return -EPERM;
+}
+
+static int pcd_open(struct inode *inode, struct file *filp)
+{
+    struct pcdev_private_data *dev_data;
+    u64 start = ktime_get_ns();
+    int ret;
+
+    /* the file keeps the device data, the device may be removed meanwhile */
+    dev_data = pcd_dev_get(inode);
+    if (!dev_data)
+    {
+        return -ENODEV;
+    }
+
+    /* to supply device private data to other methods of the driver */
+    filp->private_data = dev_data;
+
+    ret = check_permission(dev_data->pdata.perm, filp->f_mode);
+    if (ret)
+    {
+        goto put;
+    }
+
+    ret = pcd_counters_init(dev_data);
+    if (ret)
+    {
+        goto put;
+    }
+
+    /* A FIFO has no file position, lseek/pread/pwrite make no sense on it */
+    if (dev_data->pdata.mode == PCD_MODE_FIFO)
+    {
+        stream_open(inode, filp);
+    }
+
+    /* Reads and writes never wait for I/O and only try the lock, so io_uring
+       and RWF_NOWAIT requests are completed inline instead of in a worker
+       thread. Not on compressed devices, reading a cold page allocates and
+       decompresses, nor on devices with checksums, whose reads may wait for
+       a block write to the same page (see pcd_csum_verify()) */
+    if (!dev_data->zstore && !dev_data->csum)
+    {
+        filp->f_mode |= FMODE_NOWAIT;
+    }
+
+    pcd_stats_account(dev_data, PCD_STAT_OPEN, 0);
+    pcd_latency_account(dev_data, PCD_LAT_OPEN, start);
+    return 0;
+
+put:
+    pcd_dev_put(dev_data);
+    return ret;
+}
+
+/* Maps the device page on first access, allocating it if needed */
+static vm_fault_t pcd_vm_fault(struct vm_fault *vmf)
+{
+    struct pcdev_private_data *dev_data = vmf->vma->vm_private_data;
+    void *page;
+
+    /* mapped devices only grow, a stale size is always small enough */
+    if (((loff_t)vmf->pgoff << PAGE_SHIFT) >= READ_ONCE(dev_data->pdata.size))
+    {
+        return VM_FAULT_SIGBUS;
+    }
+
+    /* writes through a shared mapping cannot be seen, snapshots taken
+       before the mapping was created keep the page as it is now */
+    if ((vmf->vma->vm_flags & VM_SHARED) && (vmf->vma->vm_flags & VM_MAYWRITE) &&
+        pcd_snap_preserve(dev_data, vmf->pgoff))
+    {
+        return VM_FAULT_OOM;
+    }
+
+    page = pcd_storage_page(dev_data, vmf->pgoff);
+    if (!page)
+    {
+        return VM_FAULT_OOM;
+    }
+
+    /* writes through a shared mapping cannot be tracked, see pcd_persist_writeback()
+       and pcd_csum_verify() */
+    if ((dev_data->backing || dev_data->csum) && (vmf->vma->vm_flags & VM_SHARED) && (vmf->vma->vm_flags & VM_MAYWRITE))
+    {
+        xa_set_mark(&dev_data->pages, vmf->pgoff, PCD_PAGE_MAPPED);
+    }
+
+    /* reserved memory has no struct pages to hand out, see pcd_mmap() */
+    if (dev_data->persist_mem)
+    {
+        return vmf_insert_pfn(vmf->vma, vmf->address, PHYS_PFN(dev_data->pdata.mem_base) + vmf->pgoff);
+    }
+
+    /* the mapping holds its own reference to the page */
+    get_page(page);
+    vmf->page = page;
+    return 0;
+}
+
+/* vm_area_struct gets duplicated (fork, split) */
+static void pcd_vm_open(struct vm_area_struct *vma)
+{
+    struct pcdev_private_data *dev_data = vma->vm_private_data;
+
+    atomic_inc(&dev_data->nr_mmaps);
+}
+
+static void pcd_vm_close(struct vm_area_struct *vma)
+{
+    struct pcdev_private_data *dev_data = vma->vm_private_data;
+
+    atomic_dec(&dev_data->nr_mmaps);
+}
+
+static const struct vm_operations_struct pcd_vm_ops = {
+    .open = pcd_vm_open,
+    .close = pcd_vm_close,
+    .fault = pcd_vm_fault
+};
+
+static int pcd_mmap(struct file *filp, struct vm_area_struct *vma)
+{
+    struct pcdev_private_data *dev_data = filp->private_data;
+    unsigned long map_size;
+    unsigned long offset = vma->vm_pgoff << PAGE_SHIFT;
+    unsigned long len = vma->vm_end - vma->vm_start;
+    unsigned int slot;
+
+    /* Data in a FIFO moves around, it cannot be mapped */
+    if (dev_data->pdata.mode == PCD_MODE_FIFO)
+    {
+        return -ENODEV;
+    }
+
+    /* Device permissions become VM protections. A write-only mapping cannot
+       be expressed by the MMU, so write-only devices cannot be mapped at all */
+    if (!(dev_data->pdata.perm & RDONLY))
+    {
+        return -EACCES;
+    }
+    if (!(dev_data->pdata.perm & WRONLY))
+    {
+        if (vma->vm_flags & VM_WRITE)
+        {
+            return -EACCES;
+        }
+        /* do not allow mprotect() to make the mapping writable later */
+        pcd_vm_flags_mod(vma, 0, VM_MAYWRITE);
+    }
+
+    /* A reserved memory region is mapped by PFN. Such a mapping cannot copy
+       a page on write, so private mappings of it stay read-only */
+    if (dev_data->persist_mem)
+    {
+        if (!(vma->vm_flags & VM_SHARED))
+        {
+            if (vma->vm_flags & VM_WRITE)
+            {
+                return -EINVAL;
+            }
+            pcd_vm_flags_mod(vma, 0, VM_MAYWRITE);
+        }
+        pcd_vm_flags_mod(vma, VM_PFNMAP, 0);
+    }
+
+    /* Device pages are mapped directly on fault, user space accesses them
+       without copies */
+    pcd_vm_flags_mod(vma, VM_DONTEXPAND | VM_DONTDUMP, 0);
+    vma->vm_ops = &pcd_vm_ops;
+    vma->vm_private_data = dev_data;
+
+    /* under the lock, so a discard or a shrink cannot race with a new mapping */
+    slot = pcd_down_read(&dev_data->lock);
+
+    /* The mapping has to fit into the (page aligned) device storage */
+    map_size = PAGE_ALIGN(dev_data->pdata.size);
+    if (offset >= map_size || len > map_size - offset)
+    {
+        pcd_up_read(&dev_data->lock, slot);
+        return -EINVAL;
+    }
+
+    atomic_inc(&dev_data->nr_mmaps);
+    pcd_up_read(&dev_data->lock, slot);
+    return 0;
+}
+
+/* Writes the contents back to the backing file, if there is one */
+static int pcd_fsync(struct file *filp, loff_t start, loff_t end, int datasync)
+{
+    return pcd_persist_sync(filp->private_data, datasync);
+}
+
+static int pcd_release(struct inode *inode, struct file *filp)
+{
+    pcd_stats_account(filp->private_data, PCD_STAT_RELEASE, 0);
+    pcd_dev_put(filp->private_data);
+    return 0;
+}
+
+/* File operations for the driver */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 19, 0)
+/* Executes a passthrough command. Commands are completed inline, a command
+   that would have to sleep while io_uring issues it nonblocking returns
+   -EAGAIN and is reissued from an io_uring worker */
+static int pcd_uring_cmd(struct io_uring_cmd *ioucmd, unsigned int issue_flags)
+{
+    struct pcdev_private_data *dev_data = ioucmd->file->private_data;
+    fmode_t f_mode = ioucmd->file->f_mode;
+    bool nowait = issue_flags & IO_URING_F_NONBLOCK;
+    bool write = ioucmd->cmd_op == PCD_URING_CMD_COPY || ioucmd->cmd_op == PCD_URING_CMD_FILL;
+    u64 max_size;
+    struct pcd_uring_cmd cmd;
+    struct iov_iter iter;
+#if LINUX_VERSION_CODE < KERNEL_VERSION(6, 7, 0)
+    struct iovec iov;
+#endif
+    ssize_t ret;
+    u32 crc;
+    unsigned int slot = 0;
+
+    /* the payload does not fit in a 64 byte SQE */
+    if (!(issue_flags & IO_URING_F_SQE128))
+    {
+        return -EINVAL;
+    }
+
+    if (dev_data->pdata.mode == PCD_MODE_FIFO)
+    {
+        return -EINVAL;
+    }
+
+    /* user space may still change the SQE, work on a copy */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 6, 0)
+    memcpy(&cmd, io_uring_sqe_cmd(ioucmd->sqe), sizeof(cmd));
+#else
+    memcpy(&cmd, ioucmd->cmd, sizeof(cmd));
+#endif
+
+    if (cmd.flags)
+    {
+        return -EINVAL;
+    }
+
+    switch (ioucmd->cmd_op)
+    {
+        case PCD_URING_CMD_COPY:
+            if ((f_mode & (FMODE_READ | FMODE_WRITE)) != (FMODE_READ | FMODE_WRITE))
+            {
+                return -EBADF;
+            }
+            break;
+        case PCD_URING_CMD_FILL:
+            if (!(f_mode & FMODE_WRITE))
+            {
+                return -EBADF;
+            }
+            break;
+        case PCD_URING_CMD_CHECKSUM:
+        case PCD_URING_CMD_SNAPSHOT:
+            if (!(f_mode & FMODE_READ))
+            {
+                return -EBADF;
+            }
+            break;
+        default:
+            return -ENOTTY;
+    }
+
+    /* reads of devices without FMODE_NOWAIT may sleep, see pcd_open() */
+    if (nowait && !(f_mode & FMODE_NOWAIT))
+    {
+        return -EAGAIN;
+    }
+
+    /* same rules as for read_iter and write_iter */
+    if (write && nowait)
+    {
+        if (!pcd_down_write_trylock(&dev_data->lock))
+        {
+            return -EAGAIN;
+        }
+    }
+    else if (write)
+    {
+        pcd_down_write(&dev_data->lock);
+    }
+    else if (nowait)
+    {
+        if (!pcd_down_read_trylock(&dev_data->lock, &slot))
+        {
+            return -EAGAIN;
+        }
+    }
+    else
+    {
+        slot = pcd_down_read(&dev_data->lock);
+    }
+
+    max_size = dev_data->pdata.size;
+    if (cmd.len > max_size || cmd.off > max_size - cmd.len)
+    {
+        ret = -EINVAL;
+        goto unlock;
+    }
+    cmd.len = min_t(u64, cmd.len, MAX_RW_COUNT);
+
+    switch (ioucmd->cmd_op)
+    {
+        case PCD_URING_CMD_COPY:
+            ret = pcd_copy_range(dev_data, cmd.off, dev_data, cmd.addr, cmd.len);
+            break;
+        case PCD_URING_CMD_FILL:
+            ret = pcd_storage_fill(dev_data, cmd.off, cmd.len, cmd.value);
+            break;
+        case PCD_URING_CMD_CHECKSUM:
+            ret = pcd_storage_crc32c(dev_data, cmd.off, cmd.len, &crc);
+            if (!ret)
+            {
+                ret = put_user(crc, (u32 __user *)u64_to_user_ptr(cmd.addr)) ? -EFAULT : cmd.len;
+            }
+            break;
+        default:
+            /* PCD_URING_CMD_SNAPSHOT, writers are kept out for the whole copy */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 7, 0)
+            ret = import_ubuf(ITER_DEST, u64_to_user_ptr(cmd.addr), cmd.len, &iter);
+#else
+            ret = import_single_range(READ, u64_to_user_ptr(cmd.addr), cmd.len, &iov, &iter);
+#endif
+            if (!ret)
+            {
+                ret = pcd_storage_read(dev_data, cmd.off, cmd.len, &iter);
+            }
+            break;
+    }
+
+unlock:
+    if (write)
+    {
+        pcd_up_write(&dev_data->lock);
+    }
+    else
+    {
+        pcd_up_read(&dev_data->lock, slot);
+    }
+
+    return ret;
+}
+#endif
+
+static struct file_operations pcd_fops = {
+    .open = pcd_open,
+    .read_iter = pcd_read_iter,
+    .write_iter = pcd_write_iter,
+    /* Up to 6.4 splice reads hand the device pages themselves to the pipe,
+       except for those of reserved memory. Later kernels and splice writes
+       copy the data once */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 5, 0)
+    .splice_read = copy_splice_read,
+#else
+    .splice_read = generic_file_splice_read,
+#endif
+    .splice_write = iter_file_splice_write,
+    .llseek = pcd_lseek,
+    .mmap = pcd_mmap,
+    .fsync = pcd_fsync,
+    .poll = pcd_poll,
+    .unlocked_ioctl = pcd_ioctl,
+    .compat_ioctl = compat_ptr_ioctl,
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 19, 0)
+    .uring_cmd = pcd_uring_cmd,
+#endif
+    .release = pcd_release,
+    .owner = THIS_MODULE
+};
+
+/* Transfers the segments of a read or write request. Both directions take
+   the read side of the device lock: the block layer does not order
+   overlapping requests anyway and pages are allocated safely in parallel
+   (see pcd_storage_page()), so requests only have to be kept away from
+   discard and resize. This lets block writes scale across CPUs, but they
+   are not atomic with respect to readers of the char device */
+static blk_status_t pcd_blk_rw(struct pcdev_private_data *dev_data, struct request *rq)
+{
+    loff_t pos = (loff_t)blk_rq_pos(rq) << SECTOR_SHIFT;
+    bool write = rq_data_dir(rq) == WRITE;
+    blk_status_t status = BLK_STS_OK;
+    struct req_iterator iter;
+    struct bio_vec bvec;
+    struct iov_iter it;
+    unsigned int noio_flags;
+    ssize_t ret;
+    unsigned int slot;
+
+    slot = pcd_down_read(&dev_data->lock);
+
+    /* the device may have shrunk since the request was queued */
+    if (pos + blk_rq_bytes(rq) > dev_data->pdata.size)
+    {
+        pcd_up_read(&dev_data->lock, slot);
+        return BLK_STS_IOERR;
+    }
+
+    /* page allocations must not recurse into I/O to this very device */
+    noio_flags = memalloc_noio_save();
+    rq_for_each_segment(bvec, rq, iter)
+    {
+        iov_iter_bvec(&it, write ? WRITE : READ, &bvec, 1, bvec.bv_len);
+        if (write)
+        {
+            ret = pcd_storage_write(dev_data, pos, bvec.bv_len, &it);
+        }
+        else
+        {
+            ret = pcd_storage_read(dev_data, pos, bvec.bv_len, &it);
+        }
+
+        if (ret != bvec.bv_len)
+        {
+            status = errno_to_blk_status(ret < 0 ? ret : -EIO);
+            break;
+        }
+        pos += bvec.bv_len;
+    }
+    memalloc_noio_restore(noio_flags);
+
+    pcd_up_read(&dev_data->lock, slot);
+    return status;
+}
+
+/* Discards and write zeroes release whole pages like PCD_IOC_DISCARD. That
+   is refused while the device is mapped, the range is zeroed in place then */
+static blk_status_t pcd_blk_discard(struct pcdev_private_data *dev_data, struct request *rq)
+{
+    loff_t pos = (loff_t)blk_rq_pos(rq) << SECTOR_SHIFT;
+    unsigned int len = blk_rq_bytes(rq);
+    long ret;
+    unsigned int slot;
+
+    ret = pcd_discard(dev_data, pos, len);
+    if (ret == -EBUSY)
+    {
+        slot = pcd_down_read(&dev_data->lock);
+        if (pos + len > dev_data->pdata.size)
+        {
+            ret = -EINVAL;
+        }
+        else
+        {
+            ret = pcd_storage_fill(dev_data, pos, len, 0);
+        }
+        pcd_up_read(&dev_data->lock, slot);
+    }
+
+    return ret < 0 ? errno_to_blk_status(ret) : BLK_STS_OK;
+}
+
+/* Requests are served synchronously on the submitting CPU, there is one
+   hardware queue per CPU so that nothing is shared between them */
+static blk_status_t pcd_blk_queue_rq(struct blk_mq_hw_ctx *hctx, const struct blk_mq_queue_data *bd)
+{
+    struct pcdev_private_data *dev_data = hctx->queue->queuedata;
+    struct request *rq = bd->rq;
+    blk_status_t status;
+
+    blk_mq_start_request(rq);
+
+    switch (req_op(rq))
+    {
+        case REQ_OP_READ:
+        case REQ_OP_WRITE:
+            status = pcd_blk_rw(dev_data, rq);
+            break;
+        case REQ_OP_DISCARD:
+        case REQ_OP_WRITE_ZEROES:
+            status = pcd_blk_discard(dev_data, rq);
+            break;
+        case REQ_OP_FLUSH:
+            /* only sent with a backing file, which acts as a write cache */
+            status = errno_to_blk_status(pcd_persist_sync(dev_data, 0));
+            break;
+        default:
+            status = BLK_STS_NOTSUPP;
+            break;
+    }
+
+    blk_mq_end_request(rq, status);
+    return BLK_STS_OK;
+}
+
+static const struct blk_mq_ops pcd_blk_mq_ops = {
+    .queue_rq = pcd_blk_queue_rq,
+};
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 18, 0)
+/* The last reference to the disk is gone, see pcd_blk_add() */
+static void pcd_blk_free_disk(struct gendisk *disk)
+{
+    pcd_dev_put(disk->private_data);
+}
+#endif
+
+static const struct block_device_operations pcd_blk_fops = {
+    .owner = THIS_MODULE,
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 18, 0)
+    .free_disk = pcd_blk_free_disk,
+#endif
+};
+
+/* Drops a disk that is not (or no longer) added */
+static void pcd_blk_put_disk(struct gendisk *disk)
+{
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 0, 0)
+    put_disk(disk);
+#else
+    blk_cleanup_disk(disk);
+#endif
+}
+
+/* Creates /dev/pcdblkN on top of the storage of a linear device */
+static int pcd_blk_add(struct pcdev_private_data *dev_data, struct device *parent, int index)
+{
+    struct blk_mq_tag_set *set = &dev_data->tag_set;
+    struct gendisk *disk;
+    int ret;
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 9, 0)
+    struct queue_limits lim = {
+        .logical_block_size = SECTOR_SIZE,
+        .physical_block_size = PAGE_SIZE,
+        .max_hw_discard_sectors = UINT_MAX,
+        .max_write_zeroes_sectors = UINT_MAX,
+        .discard_granularity = PAGE_SIZE,
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 11, 0)
+        .features = dev_data->backing ? BLK_FEAT_WRITE_CACHE : 0,
+#endif
+    };
+#endif
+
+    set->ops = &pcd_blk_mq_ops;
+    set->nr_hw_queues = nr_cpu_ids;
+    set->queue_depth = PCD_BLK_QUEUE_DEPTH;
+    set->numa_node = NUMA_NO_NODE;
+    /* queue_rq() sleeps on the device lock and allocates pages */
+    set->flags = BLK_MQ_F_BLOCKING;
+#if LINUX_VERSION_CODE < KERNEL_VERSION(6, 14, 0)
+    set->flags |= BLK_MQ_F_SHOULD_MERGE;
+#endif
+
+    ret = blk_mq_alloc_tag_set(set);
+    if (ret)
+    {
+        return ret;
+    }
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 9, 0)
+    disk = blk_mq_alloc_disk(set, &lim, dev_data);
+#else
+    disk = blk_mq_alloc_disk(set, dev_data);
+#endif
+    if (IS_ERR(disk))
+    {
+        ret = PTR_ERR(disk);
+        goto err_tag_set;
+    }
+
+#if LINUX_VERSION_CODE < KERNEL_VERSION(6, 9, 0)
+    blk_queue_logical_block_size(disk->queue, SECTOR_SIZE);
+    blk_queue_physical_block_size(disk->queue, PAGE_SIZE);
+    blk_queue_max_discard_sectors(disk->queue, UINT_MAX);
+    blk_queue_max_write_zeroes_sectors(disk->queue, UINT_MAX);
+    disk->queue->limits.discard_granularity = PAGE_SIZE;
+#endif
+#if LINUX_VERSION_CODE < KERNEL_VERSION(5, 19, 0)
+    blk_queue_flag_set(QUEUE_FLAG_DISCARD, disk->queue);
+#endif
+#if LINUX_VERSION_CODE < KERNEL_VERSION(6, 11, 0)
+    blk_queue_flag_set(QUEUE_FLAG_NONROT, disk->queue);
+    blk_queue_write_cache(disk->queue, dev_data->backing != NULL, false);
+#endif
+
+    /* no major is set, so the disk gets dynamic device numbers */
+    disk->fops = &pcd_blk_fops;
+    disk->private_data = dev_data;
+    snprintf(disk->disk_name, DISK_NAME_LEN, "pcdblk%d", index);
+    set_capacity(disk, dev_data->pdata.size >> SECTOR_SHIFT);
+
+    ret = device_add_disk(parent, disk, NULL);
+    if (ret)
+    {
+        goto err_disk;
+    }
+
+    /* the disk may stay open after the device is removed, its release still
+       needs the tag set. Older kernels do not tell when it is released */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 18, 0)
+    kref_get(&dev_data->ref);
+#endif
+    dev_data->disk = disk;
+    return 0;
+
+err_disk:
+    pcd_blk_put_disk(disk);
+err_tag_set:
+    blk_mq_free_tag_set(set);
+    return ret;
+}
+
+static void pcd_blk_del(struct pcdev_private_data *dev_data)
+{
+    if (!dev_data->disk)
+    {
+        return;
+    }
+
+    /* waits for the requests in flight, later ones fail */
+    del_gendisk(dev_data->disk);
+    pcd_blk_put_disk(dev_data->disk);
+    blk_mq_free_tag_set(&dev_data->tag_set);
+    dev_data->disk = NULL;
+}
+
+/* devm action releasing the minor of a device, files opened from now on do
+   not find it anymore */
+static void pcd_minor_free(void *data)
+{
+    struct pcdev_private_data *dev_data = data;
+
+    xa_erase(&pcd_minors, MINOR(dev_data->dev_num) - MINOR(pcdrv_data.device_num_base));
+}
+
+/* Records the duration of a successful probe that started at @start */
+static void pcd_probe_account(u64 start)
+{
+    u64 end = ktime_get_boottime_ns();
+
+    spin_lock(&pcdrv_data.probe_lock);
+    if (!pcdrv_data.probed++ || start < pcdrv_data.probe_first_ns)
+    {
+        pcdrv_data.probe_first_ns = start;
+    }
+    pcdrv_data.probe_last_ns = max(pcdrv_data.probe_last_ns, end);
+    pcdrv_data.probe_total_ns += end - start;
+    pcdrv_data.probe_max_ns = max(pcdrv_data.probe_max_ns, end - start);
+    spin_unlock(&pcdrv_data.probe_lock);
+}
+
+/* <debugfs>/pcd/probe, the times are nanoseconds since boot. last_done_ns
+   is the boot-to-all-devices-ready time once every node has been probed */
+static int pcd_debugfs_probe_show(struct seq_file *s, void *unused)
+{
+    spin_lock(&pcdrv_data.probe_lock);
+    seq_printf(s, "devices %u\n", pcdrv_data.probed);
+    seq_printf(s, "first_start_ns %llu\n", pcdrv_data.probe_first_ns);
+    seq_printf(s, "last_done_ns %llu\n", pcdrv_data.probe_last_ns);
+    seq_printf(s, "total_ns %llu\n", pcdrv_data.probe_total_ns);
+    seq_printf(s, "max_ns %llu\n", pcdrv_data.probe_max_ns);
+    spin_unlock(&pcdrv_data.probe_lock);
+    return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(pcd_debugfs_probe);
+
+/* gets called when the device is removed from the system */
+static void pcd_platform_driver_remove(struct platform_device *pdev)
+{
+    struct pcdev_private_data *dev_data = dev_get_drvdata(&pdev->dev);
+
+    /* 1. Remove a device that was created with device_create() */
+    debugfs_remove_recursive(dev_data->debugfs_dir);
+    device_destroy(pcdrv_data.class_pcd, dev_data->dev_num);
+
+    /* 2. Remove the block device, if any */
+    pcd_blk_del(dev_data);
 
-    /* 2. Remove a cdev entry from the system */
-    cdev_del(&dev_data->cdev);
+    /* 3. Remove a cdev entry from the system */
+    cdev_del(dev_data->cdev);
 
-    /* 3. Free the memory held by the device
-          Not needed because there is devm_kzmalloc used in the probe function */
-    // kfree(dev_data->buffer);
-    // kfree(dev_data);
+    /* 4. Free the memory held by the device
+          Not needed here, the devm actions drop the reference of the device
+          and the last user frees it, see pcd_dev_release() */
 
-    pcdrv_data.total_devices--;
+    dev_dbg(&pdev->dev, "A device is removed\n");
+}
 
-    dev_info(&pdev->dev, "A device is removed\n");
+#if LINUX_VERSION_CODE < KERNEL_VERSION(6, 11, 0)
+/* remove() returned an error code nobody looked at before 6.11 */
+static int pcd_platform_driver_remove_int(struct platform_device *pdev)
+{
+    pcd_platform_driver_remove(pdev);
     return 0;
 }
+#endif
 
-struct pcdev_platform_data* pcdev_get_platdata_from_dt(struct device *dev)
+static struct pcdev_platform_data* pcdev_get_platdata_from_dt(struct device *dev)
 {
     struct device_node *dev_node = dev->of_node;
     struct pcdev_platform_data *pdata;
+    struct device_node *mem_node;
+    struct reserved_mem *rmem;
+    u32 size;
 
     if (!dev_node)
     {
@@ -151,16 +4848,21 @@ struct pcdev_platform_data* pcdev_get_platdata_from_dt(struct device *dev)
         return ERR_PTR(-ENOMEM);
     }
 
-    if (of_property_read_string(dev_node, "org,device-serial-num", &pdata->serial_number));
+    if (of_property_read_string(dev_node, "org,device-serial-num", &pdata->serial_number))
     {
         dev_info(dev, "Missing serial number property\n");
         return ERR_PTR(-EINVAL);
     }
 
-    if (of_property_read_u32(dev_node, "org,size", &pdata->size))
+    /* org,size takes two cells for buffers of 4 GiB and more */
+    if (of_property_read_u64(dev_node, "org,size", &pdata->size))
     {
-        dev_info(dev, "Missing size property\n");
-        return ERR_PTR(-EINVAL);
+        if (of_property_read_u32(dev_node, "org,size", &size))
+        {
+            dev_info(dev, "Missing size property\n");
+            return ERR_PTR(-EINVAL);
+        }
+        pdata->size = size;
     }
 
     if (of_property_read_u32(dev_node, "org,perm", &pdata->perm))
@@ -169,6 +4871,34 @@ struct pcdev_platform_data* pcdev_get_platdata_from_dt(struct device *dev)
         return ERR_PTR(-EINVAL);
     }
 
+    /* optional property, the device is a plain memory when it is missing */
+    if (of_property_match_string(dev_node, "org,mode", "fifo") >= 0)
+    {
+        pdata->mode = PCD_MODE_FIFO;
+    }
+
+    /* optional persistence, see pcd_persist_attach() */
+    mem_node = of_parse_phandle(dev_node, "memory-region", 0);
+    if (mem_node)
+    {
+        rmem = of_reserved_mem_lookup(mem_node);
+        of_node_put(mem_node);
+        if (!rmem)
+        {
+            dev_info(dev, "Invalid memory-region property\n");
+            return ERR_PTR(-EINVAL);
+        }
+        pdata->mem_base = rmem->base;
+        pdata->mem_size = rmem->size;
+    }
+    of_property_read_string(dev_node, "org,backing-file", &pdata->backing_file);
+
+    /* optional compression of cold pages, see pcd_zstore_attach() */
+    of_property_read_string(dev_node, "org,compress", &pdata->compressor);
+
+    /* optional per-page checksums, see pcd_csum_attach() */
+    pdata->checksum = of_property_read_bool(dev_node, "org,checksum");
+
     return pdata;
 }
 
@@ -177,7 +4907,7 @@ struct pcdev_platform_data* pcdev_get_platdata_from_dt(struct device *dev)
  * - using device_setup as previously
  * - using Device Tree propertiess
 */
-int pcd_platform_driver_probe(struct platform_device *pdev)
+static int pcd_platform_driver_probe(struct platform_device *pdev)
 {
     int ret;
     
@@ -189,9 +4919,17 @@ int pcd_platform_driver_probe(struct platform_device *pdev)
 
     struct device *dev = &pdev->dev;
 
+    struct device *device;
+
     int driver_data;
 
-    dev_info(dev, "A device is detected\n");
+    u32 index;
+
+    u64 start = ktime_get_boottime_ns();
+
+    /* Probes of hundreds of devices run in parallel at boot, everything
+       informational goes to the debug level to keep the console quiet */
+    dev_dbg(dev, "A device is detected\n");
 
     /* 1. Get the platform data */
     // pdata = pdev->dev.platform_data;
@@ -203,7 +4941,7 @@ int pcd_platform_driver_probe(struct platform_device *pdev)
         {
             return PTR_ERR(pdata);
         }
-        driver_data = *(int*)(match->data);
+        driver_data = (long)match->data;
     }
     else
     {
@@ -218,86 +4956,598 @@ int pcd_platform_driver_probe(struct platform_device *pdev)
         driver_data = pdev->id_entry->driver_data;
     }
 
-    /* 2. Dynamically allocate memory for the device private data */
-    dev_data = devm_kzalloc(dev, sizeof(*dev_data), GFP_KERNEL);
+    /* 2. Dynamically allocate memory for the device private data. It is
+          not devm managed, open files may use it after remove() */
+    dev_data = kzalloc(sizeof(*dev_data), GFP_KERNEL);
     if (!dev_data)
     {
         dev_err(dev, "Cannot allocate memory\n");
         return -ENOMEM;
     }
+    kref_init(&dev_data->ref);
+
+    /* everything set up from here on is released with the last reference */
+    ret = devm_add_action_or_reset(dev, pcd_dev_put, dev_data);
+    if (ret)
+    {
+        return ret;
+    }
 
     /* save the device private data pointer in platform_device structure */
     dev_set_drvdata(dev, dev_data);
 
+    /* the platform data of a configfs instance goes away with the instance,
+       the strings are copied, see pcd_dev_release() */
+    dev_data->pdata.serial_number = kstrdup_const(pdata->serial_number, GFP_KERNEL);
+    if (!dev_data->pdata.serial_number)
+    {
+        return -ENOMEM;
+    }
+    if (pdata->backing_file)
+    {
+        dev_data->pdata.backing_file = kstrdup_const(pdata->backing_file, GFP_KERNEL);
+        if (!dev_data->pdata.backing_file)
+        {
+            return -ENOMEM;
+        }
+    }
+    if (pdata->compressor)
+    {
+        dev_data->pdata.compressor = kstrdup_const(pdata->compressor, GFP_KERNEL);
+        if (!dev_data->pdata.compressor)
+        {
+            return -ENOMEM;
+        }
+    }
+
     dev_data->pdata.size = pdata->size;
     dev_data->pdata.perm = pdata->perm;
-    dev_data->pdata.serial_number = pdata->serial_number;
+    dev_data->pdata.mode = pdata->mode;
+    dev_data->pdata.mem_base = pdata->mem_base;
+    dev_data->pdata.mem_size = pdata->mem_size;
+    dev_data->pdata.checksum = pdata->checksum;
+
+    dev_dbg(dev, "Device serial number = %s\n", dev_data->pdata.serial_number);
+    dev_dbg(dev, "Device size = %llu\n", dev_data->pdata.size);
+    dev_dbg(dev, "Device permission = %d\n", dev_data->pdata.perm);
+    dev_dbg(dev, "Device mode = %s\n", dev_data->pdata.mode == PCD_MODE_FIFO ? "fifo" : "linear");
+
+    dev_dbg(dev, "Config item 1 = %d\n", pcdev_config[driver_data].config_item1);
+    dev_dbg(dev, "Config item 2 = %d\n", pcdev_config[driver_data].config_item2);
+
+    /* 3. Prepare the device storage. Nothing is allocated here, pages of
+    the buffer are allocated on first write, so even buffers of many GB
+    do not slow down the probe nor need contiguous memory */
+    xa_init(&dev_data->pages);
+    atomic_long_set(&dev_data->nr_pages, 0);
+    atomic_set(&dev_data->nr_mmaps, 0);
+    atomic_set(&dev_data->nr_rings, 0);
+
+    pcd_lock_init(&dev_data->lock);
+
+    mutex_init(&dev_data->fifo_lock);
+    init_waitqueue_head(&dev_data->fifo_readq);
+    init_waitqueue_head(&dev_data->fifo_writeq);
 
-    dev_info(dev, "Device serial number = %s\n", dev_data->pdata.serial_number);
-    dev_info(dev, "Device size = %d\n", dev_data->pdata.size);
-    dev_info(dev, "Device permission = %d\n", dev_data->pdata.perm);
+    INIT_LIST_HEAD(&dev_data->snapshots);
+    mutex_init(&dev_data->cow_lock);
+    atomic_long_set(&dev_data->nr_snap_pages, 0);
 
-    dev_info(dev, "Config item 1 = %d\n", pcdev_config[driver_data].config_item1);
-    dev_info(dev, "Config item 2 = %d\n", pcdev_config[driver_data].config_item2);
+    /* statistics are allocated on first open, see pcd_counters_init() */
 
-    /* 3. Dynamically allocate memory for the device buffer using size 
-    information from the platform data */
-    dev_data->buffer = devm_kzalloc(dev, dev_data->pdata.size, GFP_KERNEL);
-    if (!dev_data->buffer)
+    /* persistent contents are attached before the device becomes visible */
+    ret = pcd_persist_attach(dev_data, dev);
+    if (ret)
     {
-        dev_err(dev, "Cannot allocate memory\n");
-        return -ENOMEM;
+        return ret;
+    }
+
+    /* before the compression, compressed pages keep their checksum */
+    ret = pcd_csum_attach(dev_data, dev);
+    if (ret)
+    {
+        return ret;
+    }
+
+    ret = pcd_zstore_attach(dev_data, dev);
+    if (ret)
+    {
+        return ret;
     }
 
     /* 4. Get the device number */
-    dev_data->dev_num = pcdrv_data.device_num_base + pcdrv_data.total_devices;
+    ret = xa_alloc(&pcd_minors, &index, dev_data, XA_LIMIT(0, PCD_MAX_DEVICES - 1), GFP_KERNEL);
+    if (ret)
+    {
+        dev_err(dev, "No device number left\n");
+        return ret == -EBUSY ? -ENOSPC : ret;
+    }
+    dev_data->dev_num = pcdrv_data.device_num_base + index;
+
+    /* the minor is released after remove() has deleted the cdev */
+    ret = devm_add_action_or_reset(dev, pcd_minor_free, dev_data);
+    if (ret)
+    {
+        return ret;
+    }
 
-    /* 5. Do cdev init and cdev add */
-    cdev_init(&dev_data->cdev, &pcd_fops);
+    /* 5. Do cdev alloc and cdev add */
+    dev_data->cdev = cdev_alloc();
+    if (!dev_data->cdev)
+    {
+        return -ENOMEM;
+    }
 
-    dev_data->cdev.owner = THIS_MODULE;
-    ret = cdev_add(&dev_data->cdev, dev_data->dev_num, 1);
+    dev_data->cdev->ops = &pcd_fops;
+    dev_data->cdev->owner = THIS_MODULE;
+    ret = cdev_add(dev_data->cdev, dev_data->dev_num, 1);
     if (ret < 0)
     {
         dev_err(dev, "Cdev add failed\n");
+        kobject_put(&dev_data->cdev->kobj);
         return ret;
     }
 
-    /* 6. Create device file for the detected platform device */
-    pcdrv_data.device_pcd = device_create(pcdrv_data.class_pcd, dev, dev_data->dev_num, NULL, "pcdev-%d", pcdrv_data.total_devices);
-    if (IS_ERR(pcdrv_data.device_pcd))
+    /* 6. Block device sharing the storage, only random access devices have
+          one. The char device works without it, so failures are not fatal */
+    if (blkdev && dev_data->pdata.mode == PCD_MODE_LINEAR)
+    {
+        ret = pcd_blk_add(dev_data, dev, index);
+        if (ret)
+        {
+            dev_warn(dev, "Block device create failed (%d)\n", ret);
+        }
+    }
+
+    /* 7. Create device file for the detected platform device */
+    device = device_create_with_groups(pcdrv_data.class_pcd, dev, dev_data->dev_num, dev_data,
+                                       pcd_dev_groups, "pcdev-%u", index);
+    if (IS_ERR(device))
     {
         dev_err(dev, "Device create failed\n");
-        ret = PTR_ERR(pcdrv_data.device_pcd);
-        cdev_del(&dev_data->cdev);
+        ret = PTR_ERR(device);
+        pcd_blk_del(dev_data);
+        cdev_del(dev_data->cdev);
         return ret;
     }
 
-    pcdrv_data.total_devices++;
+    /* 8. Statistics are also available in debugfs, failures here are not fatal */
+    dev_data->debugfs_dir = debugfs_create_dir(dev_name(device), pcdrv_data.debugfs_root);
+    debugfs_create_file("stats", 0444, dev_data->debugfs_dir, dev_data, &pcd_debugfs_stats_fops);
+    debugfs_create_file("latency", 0644, dev_data->debugfs_dir, dev_data, &pcd_debugfs_latency_fops);
+
+    pcd_probe_account(start);
 
-    dev_info(dev, "Probe was succesful\n");
+    dev_dbg(dev, "Probe was succesful\n");
 
     return 0;
 }
 
-struct platform_driver pcd_platform_driver = {
+static struct platform_driver pcd_platform_driver = {
     .probe = pcd_platform_driver_probe,
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 11, 0)
     .remove = pcd_platform_driver_remove,
+#else
+    .remove = pcd_platform_driver_remove_int,
+#endif
     .id_table = pcdevs_ids,
     .driver = { /* this member is mandatory */
         .name = "pseudo-char-device",
+        /* probe the devices in parallel, the driver core waits for them
+           only where it has to (e.g. before mounting the root fs) */
+        .probe_type = PROBE_PREFER_ASYNCHRONOUS,
         /* of_match_ptr returns NULL if CONFIG_OF is disabled.
            CONFIG_OF is enabled during kernel compilation */
         .of_match_table = of_match_ptr(org_pcdev_dt_match)
     }
 };
 
+/*
+ * Runtime instances, created through configfs:
+ *
+ *   mkdir /sys/kernel/config/pcd/job0
+ *   echo 1048576 > /sys/kernel/config/pcd/job0/size
+ *   echo 0x11 > /sys/kernel/config/pcd/job0/perm
+ *   echo 1 > /sys/kernel/config/pcd/job0/enable
+ *
+ * Enabling an instance registers a platform device carrying its settings as
+ * platform data, the device is probed by this driver like any other one.
+ * rmdir destroys the instance together with its device. Files, mappings
+ * and snapshots still open keep using the data of the removed device until
+ * they are closed. An instance with a backing_file keeps its contents in
+ * that file, written back when the last of them is gone, enabling it again
+ * (or an instance with the same file after a module reload) brings them back.
+ * compress names the compressor of cold pages ("lz4", "lzo"), empty for none.
+ * checksum = 1 keeps a checksum of every page.
+ */
+struct pcd_cfs_instance
+{
+    struct config_item item;
+    struct mutex lock;
+    struct pcdev_platform_data pdata;
+    char serial_number[32];
+    char backing_file[256];
+    char compress[16];
+    struct platform_device *pdev;
+};
+
+static struct pcd_cfs_instance *to_pcd_cfs_instance(struct config_item *item)
+{
+    return container_of(item, struct pcd_cfs_instance, item);
+}
+
+/* Settings cannot change under a registered device */
+static int pcd_cfs_store_check(struct pcd_cfs_instance *inst)
+{
+    return inst->pdev ? -EBUSY : 0;
+}
+
+static ssize_t pcd_cfs_size_show(struct config_item *item, char *page)
+{
+    return sprintf(page, "%llu\n", to_pcd_cfs_instance(item)->pdata.size);
+}
+
+static ssize_t pcd_cfs_size_store(struct config_item *item, const char *page, size_t count)
+{
+    struct pcd_cfs_instance *inst = to_pcd_cfs_instance(item);
+    u64 size;
+    int ret;
+
+    ret = kstrtou64(page, 0, &size);
+    if (ret)
+    {
+        return ret;
+    }
+
+    if (!size || size > MAX_LFS_FILESIZE)
+    {
+        return -EINVAL;
+    }
+
+    mutex_lock(&inst->lock);
+    ret = pcd_cfs_store_check(inst);
+    if (!ret)
+    {
+        inst->pdata.size = size;
+    }
+    mutex_unlock(&inst->lock);
+
+    return ret ? ret : count;
+}
+
+static ssize_t pcd_cfs_perm_show(struct config_item *item, char *page)
+{
+    return sprintf(page, "0x%x\n", to_pcd_cfs_instance(item)->pdata.perm);
+}
+
+static ssize_t pcd_cfs_perm_store(struct config_item *item, const char *page, size_t count)
+{
+    struct pcd_cfs_instance *inst = to_pcd_cfs_instance(item);
+    int perm;
+    int ret;
+
+    ret = kstrtoint(page, 0, &perm);
+    if (ret)
+    {
+        return ret;
+    }
+
+    if (perm != RDWR && perm != RDONLY && perm != WRONLY)
+    {
+        return -EINVAL;
+    }
+
+    mutex_lock(&inst->lock);
+    ret = pcd_cfs_store_check(inst);
+    if (!ret)
+    {
+        inst->pdata.perm = perm;
+    }
+    mutex_unlock(&inst->lock);
+
+    return ret ? ret : count;
+}
+
+static ssize_t pcd_cfs_mode_show(struct config_item *item, char *page)
+{
+    return sprintf(page, "%s\n", to_pcd_cfs_instance(item)->pdata.mode == PCD_MODE_FIFO ? "fifo" : "linear");
+}
+
+static ssize_t pcd_cfs_mode_store(struct config_item *item, const char *page, size_t count)
+{
+    struct pcd_cfs_instance *inst = to_pcd_cfs_instance(item);
+    int mode;
+    int ret;
+
+    if (sysfs_streq(page, "linear"))
+    {
+        mode = PCD_MODE_LINEAR;
+    }
+    else if (sysfs_streq(page, "fifo"))
+    {
+        mode = PCD_MODE_FIFO;
+    }
+    else
+    {
+        return -EINVAL;
+    }
+
+    mutex_lock(&inst->lock);
+    ret = pcd_cfs_store_check(inst);
+    if (!ret)
+    {
+        inst->pdata.mode = mode;
+    }
+    mutex_unlock(&inst->lock);
+
+    return ret ? ret : count;
+}
+
+static ssize_t pcd_cfs_serial_number_show(struct config_item *item, char *page)
+{
+    return sprintf(page, "%s\n", to_pcd_cfs_instance(item)->serial_number);
+}
+
+static ssize_t pcd_cfs_serial_number_store(struct config_item *item, const char *page, size_t count)
+{
+    struct pcd_cfs_instance *inst = to_pcd_cfs_instance(item);
+    int ret;
+
+    if (!count || count > sizeof(inst->serial_number))
+    {
+        return -EINVAL;
+    }
+
+    mutex_lock(&inst->lock);
+    ret = pcd_cfs_store_check(inst);
+    if (!ret)
+    {
+        strscpy(inst->serial_number, page, sizeof(inst->serial_number));
+        strim(inst->serial_number);
+    }
+    mutex_unlock(&inst->lock);
+
+    return ret ? ret : count;
+}
+
+static ssize_t pcd_cfs_backing_file_show(struct config_item *item, char *page)
+{
+    return sprintf(page, "%s\n", to_pcd_cfs_instance(item)->backing_file);
+}
+
+static ssize_t pcd_cfs_backing_file_store(struct config_item *item, const char *page, size_t count)
+{
+    struct pcd_cfs_instance *inst = to_pcd_cfs_instance(item);
+    int ret;
+
+    if (count >= sizeof(inst->backing_file))
+    {
+        return -EINVAL;
+    }
+
+    mutex_lock(&inst->lock);
+    ret = pcd_cfs_store_check(inst);
+    if (!ret)
+    {
+        strscpy(inst->backing_file, page, sizeof(inst->backing_file));
+        strim(inst->backing_file);
+    }
+    mutex_unlock(&inst->lock);
+
+    return ret ? ret : count;
+}
+
+static ssize_t pcd_cfs_compress_show(struct config_item *item, char *page)
+{
+    return sprintf(page, "%s\n", to_pcd_cfs_instance(item)->compress);
+}
+
+static ssize_t pcd_cfs_compress_store(struct config_item *item, const char *page, size_t count)
+{
+    struct pcd_cfs_instance *inst = to_pcd_cfs_instance(item);
+    int ret;
+
+    if (count >= sizeof(inst->compress))
+    {
+        return -EINVAL;
+    }
+
+    mutex_lock(&inst->lock);
+    ret = pcd_cfs_store_check(inst);
+    if (!ret)
+    {
+        strscpy(inst->compress, page, sizeof(inst->compress));
+        strim(inst->compress);
+    }
+    mutex_unlock(&inst->lock);
+
+    return ret ? ret : count;
+}
+
+static ssize_t pcd_cfs_checksum_show(struct config_item *item, char *page)
+{
+    return sprintf(page, "%d\n", to_pcd_cfs_instance(item)->pdata.checksum);
+}
+
+static ssize_t pcd_cfs_checksum_store(struct config_item *item, const char *page, size_t count)
+{
+    struct pcd_cfs_instance *inst = to_pcd_cfs_instance(item);
+    bool checksum;
+    int ret;
+
+    ret = kstrtobool(page, &checksum);
+    if (ret)
+    {
+        return ret;
+    }
+
+    mutex_lock(&inst->lock);
+    ret = pcd_cfs_store_check(inst);
+    if (!ret)
+    {
+        inst->pdata.checksum = checksum;
+    }
+    mutex_unlock(&inst->lock);
+
+    return ret ? ret : count;
+}
+
+static ssize_t pcd_cfs_enable_show(struct config_item *item, char *page)
+{
+    return sprintf(page, "%d\n", to_pcd_cfs_instance(item)->pdev != NULL);
+}
+
+/* Unregisters the device of an instance, the caller holds inst->lock */
+static void pcd_cfs_disable(struct pcd_cfs_instance *inst)
+{
+    if (inst->pdev)
+    {
+        platform_device_unregister(inst->pdev);
+        inst->pdev = NULL;
+    }
+}
+
+static ssize_t pcd_cfs_enable_store(struct config_item *item, const char *page, size_t count)
+{
+    struct pcd_cfs_instance *inst = to_pcd_cfs_instance(item);
+    struct platform_device *pdev;
+    bool enable;
+    int ret;
+
+    ret = kstrtobool(page, &enable);
+    if (ret)
+    {
+        return ret;
+    }
+
+    mutex_lock(&inst->lock);
+    if (!enable)
+    {
+        pcd_cfs_disable(inst);
+    }
+    else if (!inst->pdev)
+    {
+        /* the platform data is copied, the probe copies the strings it keeps */
+        inst->pdata.serial_number = inst->serial_number;
+        inst->pdata.backing_file = inst->backing_file[0] ? inst->backing_file : NULL;
+        inst->pdata.compressor = inst->compress[0] ? inst->compress : NULL;
+        pdev = platform_device_register_data(NULL, "pcdev-A1x", PLATFORM_DEVID_AUTO,
+                                             &inst->pdata, sizeof(inst->pdata));
+        if (IS_ERR(pdev))
+        {
+            ret = PTR_ERR(pdev);
+            goto out;
+        }
+
+        /* The probe is asynchronous, enable only succeeds once it did.
+           device_attach() waits for a probe of this device in flight or
+           probes it right away, whatever other devices are doing */
+        if (device_attach(&pdev->dev) <= 0)
+        {
+            platform_device_unregister(pdev);
+            ret = -ENODEV;
+            goto out;
+        }
+        inst->pdev = pdev;
+    }
+out:
+    mutex_unlock(&inst->lock);
+
+    return ret ? ret : count;
+}
+
+CONFIGFS_ATTR(pcd_cfs_, size);
+CONFIGFS_ATTR(pcd_cfs_, perm);
+CONFIGFS_ATTR(pcd_cfs_, mode);
+CONFIGFS_ATTR(pcd_cfs_, serial_number);
+CONFIGFS_ATTR(pcd_cfs_, backing_file);
+CONFIGFS_ATTR(pcd_cfs_, compress);
+CONFIGFS_ATTR(pcd_cfs_, checksum);
+CONFIGFS_ATTR(pcd_cfs_, enable);
+
+static struct configfs_attribute *pcd_cfs_attrs[] = {
+    &pcd_cfs_attr_size,
+    &pcd_cfs_attr_perm,
+    &pcd_cfs_attr_mode,
+    &pcd_cfs_attr_serial_number,
+    &pcd_cfs_attr_backing_file,
+    &pcd_cfs_attr_compress,
+    &pcd_cfs_attr_checksum,
+    &pcd_cfs_attr_enable,
+    NULL
+};
+
+static void pcd_cfs_release(struct config_item *item)
+{
+    kfree(to_pcd_cfs_instance(item));
+}
+
+static struct configfs_item_operations pcd_cfs_item_ops = {
+    .release = pcd_cfs_release
+};
+
+static const struct config_item_type pcd_cfs_item_type = {
+    .ct_item_ops = &pcd_cfs_item_ops,
+    .ct_attrs = pcd_cfs_attrs,
+    .ct_owner = THIS_MODULE
+};
+
+static struct config_item *pcd_cfs_make_item(struct config_group *group, const char *name)
+{
+    struct pcd_cfs_instance *inst;
+
+    inst = kzalloc(sizeof(*inst), GFP_KERNEL);
+    if (!inst)
+    {
+        return ERR_PTR(-ENOMEM);
+    }
+
+    mutex_init(&inst->lock);
+    inst->pdata.size = PAGE_SIZE;
+    inst->pdata.perm = RDWR;
+    inst->pdata.mode = PCD_MODE_LINEAR;
+    strscpy(inst->serial_number, name, sizeof(inst->serial_number));
+
+    config_item_init_type_name(&inst->item, name, &pcd_cfs_item_type);
+    return &inst->item;
+}
+
+static void pcd_cfs_drop_item(struct config_group *group, struct config_item *item)
+{
+    struct pcd_cfs_instance *inst = to_pcd_cfs_instance(item);
+
+    mutex_lock(&inst->lock);
+    pcd_cfs_disable(inst);
+    mutex_unlock(&inst->lock);
+
+    config_item_put(item);
+}
+
+static struct configfs_group_operations pcd_cfs_group_ops = {
+    .make_item = pcd_cfs_make_item,
+    .drop_item = pcd_cfs_drop_item
+};
+
+static const struct config_item_type pcd_cfs_group_type = {
+    .ct_group_ops = &pcd_cfs_group_ops,
+    .ct_owner = THIS_MODULE
+};
+
+static struct configfs_subsystem pcd_cfs_subsys = {
+    .su_group = {
+        .cg_item = {
+            .ci_namebuf = "pcd",
+            .ci_type = &pcd_cfs_group_type
+        }
+    }
+};
+
 static int __init pcd_platform_driver_init(void)
 {
     int ret;
 
-    /* 1. Dynamically allocate a device number for MAX_DEVICES */
-    ret = alloc_chrdev_region(&pcdrv_data.device_num_base, 0, MAX_DEVICES, "pcdevs");
+    /* 1. Dynamically allocate device numbers for PCD_MAX_DEVICES */
+    ret = alloc_chrdev_region(&pcdrv_data.device_num_base, 0, PCD_MAX_DEVICES, "pcdevs");
     if (ret < 0)
     {
         pr_err("Allooc chrdev failed\n");
@@ -305,32 +5555,63 @@ static int __init pcd_platform_driver_init(void)
     }
 
     /* 2. Create device class under /sys/class */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 4, 0)
+    pcdrv_data.class_pcd = class_create("pcd_class");
+#else
     pcdrv_data.class_pcd = class_create(THIS_MODULE, "pcd_class");
+#endif
     if (IS_ERR(pcdrv_data.class_pcd))
     {
         pr_err("Class creation failed\n");
         ret = PTR_ERR(pcdrv_data.class_pcd);
-        unregister_chrdev_region(pcdrv_data.device_num_base, MAX_DEVICES);
+        unregister_chrdev_region(pcdrv_data.device_num_base, PCD_MAX_DEVICES);
         return ret;
     }
 
-    /* 3. Register a platform driver */
+    /* 3. Create the debugfs root of the devices */
+    pcdrv_data.debugfs_root = debugfs_create_dir("pcd", NULL);
+    spin_lock_init(&pcdrv_data.probe_lock);
+    debugfs_create_file("probe", 0444, pcdrv_data.debugfs_root, NULL, &pcd_debugfs_probe_fops);
+
+    /* 4. Register a platform driver */
     platform_driver_register(&pcd_platform_driver);
 
+    /* 5. Allow creating instances at runtime */
+    config_group_init(&pcd_cfs_subsys.su_group);
+    mutex_init(&pcd_cfs_subsys.su_mutex);
+    ret = configfs_register_subsystem(&pcd_cfs_subsys);
+    if (ret)
+    {
+        pr_err("configfs registration failed\n");
+        platform_driver_unregister(&pcd_platform_driver);
+        debugfs_remove_recursive(pcdrv_data.debugfs_root);
+        class_destroy(pcdrv_data.class_pcd);
+        unregister_chrdev_region(pcdrv_data.device_num_base, PCD_MAX_DEVICES);
+        return ret;
+    }
+
     pr_info("pcd platform driver loaded\n");
     return 0;
 }
 
 static void __exit pcd_platform_driver_cleanup(void)
 {
-    /* 1. Unregister the platform driver */
+    /* 1. Remove the configfs directory. Instances hold a module reference,
+          so all of them are already gone (rmdir) at this point */
+    configfs_unregister_subsystem(&pcd_cfs_subsys);
+
+    /* 2. Unregister the platform driver */
     platform_driver_unregister(&pcd_platform_driver);
 
-    /* 2. Class destroy */
+    /* 3. Remove the debugfs root */
+    debugfs_remove_recursive(pcdrv_data.debugfs_root);
+
+    /* 4. Class destroy */
     class_destroy(pcdrv_data.class_pcd);
 
-    /* 3. Unregister device numbers for MAX_DEVICES */
-    unregister_chrdev_region(pcdrv_data.device_num_base, MAX_DEVICES);
+    /* 5. Unregister device numbers for PCD_MAX_DEVICES */
+    unregister_chrdev_region(pcdrv_data.device_num_base, PCD_MAX_DEVICES);
+    xa_destroy(&pcd_minors);
     pr_info("pcd platform driver unloaded\n");
 }
 
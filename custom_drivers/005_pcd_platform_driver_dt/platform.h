@@ -1,17 +1,32 @@
 #ifndef PLATFORM_H
 #define PLATFORM_H
 
+#include <linux/types.h>
+
 #define RDWR 0x11
 #define RDONLY 0x10
 #define WRONLY 0x01
 
-#define MAX_DEVICES 10
+/* Device buffer modes */
+#define PCD_MODE_LINEAR 0 /* random access memory (default) */
+#define PCD_MODE_FIFO 1 /* blocking ring buffer, DT: org,mode = "fifo" */
 
 struct pcdev_platform_data
 {
-    int size;
+    u64 size;
     int perm;
     const char *serial_number;
+    int mode;
+    /* Persistence (optional, linear mode only). Either a reserved memory
+       region (DT: memory-region) or a file (DT: org,backing-file) */
+    phys_addr_t mem_base;
+    u64 mem_size;
+    const char *backing_file;
+    /* Compression of cold pages (optional, volatile linear devices only),
+       DT: org,compress = "lz4" or "lzo" */
+    const char *compressor;
+    /* Per-page checksums (optional, linear mode only), DT: org,checksum */
+    bool checksum;
 };
 
 #endif // PLATFORM_H
\ No newline at end of file
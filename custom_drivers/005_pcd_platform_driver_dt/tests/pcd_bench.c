@@ -0,0 +1,565 @@
+/*
+ * Benchmark for the pcdev drivers.
+ *
+ * Measures throughput, operations per second and latency percentiles of a
+ * /dev/pcdev-N device for every combination of the selected access modes,
+ * patterns, directions, block sizes and thread counts:
+ *
+ *   modes      rw     pread()/pwrite()
+ *              mmap   memcpy() from/to a shared mapping of the device
+ *              batch  PCD_IOC_BATCH, -n blocks per call (DT driver only)
+ *   patterns   seq    every thread walks its own part of the device
+ *              rand   block aligned random offsets
+ *   directions read, write
+ *
+ * Latencies are measured per call (per batch in the batch mode) and
+ * collected in log-linear histograms, percentiles are accurate to ~6%.
+ * With -S every run holds a PCD_IOC_SNAPSHOT of the device, so writes pay
+ * for preserving the pages they touch first (DT driver only). With -V the
+ * device is checked with PCD_IOC_VERIFY after every run, a page that does not
+ * match its checksum fails the run with EIO (DT driver with checksums only).
+ * Combinations the device does not support (e.g. writes to a read-only
+ * device) are reported with their errno and skipped.
+ *
+ * Build: make bench (in the driver directory)
+ * Usage: ./pcd_bench [-d device] [-m modes] [-p patterns] [-o directions]
+ *                    [-b block_sizes] [-t threads] [-s seconds] [-n batch]
+ *                    [-f text|csv|json] [-S] [-V]
+ *        lists are comma separated, e.g. -b 512,4096,65536 -t 1,2,4
+ */
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/ioctl.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <time.h>
+
+#include "../pcd_ioctl.h"
+
+#define DEFAULT_DEVICE "/dev/pcdev-0"
+#define DEFAULT_SECONDS 2
+#define DEFAULT_BATCH 64
+#define MAX_LIST 16
+
+/* log-linear histogram: 16 sub-buckets for every power of two of ns */
+#define SUB_BITS 4
+#define NR_BUCKETS (64 << SUB_BITS)
+
+enum mode { MODE_RW, MODE_MMAP, MODE_BATCH };
+enum format { FMT_TEXT, FMT_CSV, FMT_JSON };
+
+static const char *mode_names[] = { "rw", "mmap", "batch" };
+static const char *pattern_names[] = { "seq", "rand" };
+static const char *dir_names[] = { "read", "write" };
+
+struct run {
+	int mode;
+	int random;
+	int write;
+	size_t block_size;
+	int threads;
+};
+
+struct worker {
+	pthread_t thread;
+	const struct run *run;
+	int index;
+	int fd;
+	char *map;
+	unsigned long long ops;
+	unsigned long long bytes;
+	int error;
+	unsigned long long hist[NR_BUCKETS];
+};
+
+static const char *device = DEFAULT_DEVICE;
+static off_t device_size;
+static int seconds = DEFAULT_SECONDS;
+static int batch = DEFAULT_BATCH;
+static int snapshot;
+static int verify;
+static volatile int running;
+
+static unsigned long long now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static int bucket_of(unsigned long long ns)
+{
+	int msb;
+
+	if (ns < (1 << SUB_BITS))
+		return ns;
+	msb = 63 - __builtin_clzll(ns);
+	return ((msb - SUB_BITS + 1) << SUB_BITS) + ((ns >> (msb - SUB_BITS)) & ((1 << SUB_BITS) - 1));
+}
+
+/* upper bound of a bucket in ns */
+static unsigned long long bucket_limit(int bucket)
+{
+	int shift = (bucket >> SUB_BITS) - 1;
+
+	if (shift < 0)
+		return bucket + 1;
+	return ((unsigned long long)((bucket & ((1 << SUB_BITS) - 1)) + (1 << SUB_BITS) + 1)) << shift;
+}
+
+static unsigned long long percentile(const unsigned long long *hist, unsigned long long total, double p)
+{
+	unsigned long long count = 0;
+	int i;
+
+	for (i = 0; i < NR_BUCKETS; i++) {
+		count += hist[i];
+		if (count && count >= total * p)
+			return bucket_limit(i);
+	}
+	return 0;
+}
+
+/* cheap per-thread PRNG, rand() takes a lock */
+static uint64_t xorshift(uint64_t *state)
+{
+	uint64_t x = *state;
+
+	x ^= x << 13;
+	x ^= x >> 7;
+	x ^= x << 17;
+	return *state = x;
+}
+
+static void *worker_fn(void *arg)
+{
+	struct worker *w = arg;
+	const struct run *r = w->run;
+	size_t bs = r->block_size;
+	off_t blocks = device_size / bs;
+	off_t first = blocks * w->index / r->threads;
+	off_t last = blocks * (w->index + 1) / r->threads;
+	off_t block = first;
+	uint64_t seed = 0x9e3779b97f4a7c15ULL * (w->index + 1);
+	int per_call = r->mode == MODE_BATCH ? batch : 1;
+	struct pcd_io_vec *vecs = NULL;
+	struct pcd_io_batch io_batch;
+	unsigned long long start, ops = 0, bytes = 0;
+	char *buffer;
+	ssize_t ret;
+	int i;
+
+	if (last == first)
+		last = first + 1;
+
+	buffer = malloc(bs * per_call);
+	vecs = calloc(per_call, sizeof(*vecs));
+	if (!buffer || !vecs) {
+		w->error = ENOMEM;
+		goto out;
+	}
+	memset(buffer, 'x', bs * per_call);
+
+	while (running) {
+		off_t offsets[per_call];
+
+		for (i = 0; i < per_call; i++) {
+			if (r->random) {
+				offsets[i] = (xorshift(&seed) % blocks) * bs;
+			} else {
+				offsets[i] = block * bs;
+				if (++block == last)
+					block = first;
+			}
+		}
+
+		start = now_ns();
+		switch (r->mode) {
+		case MODE_RW:
+			if (r->write)
+				ret = pwrite(w->fd, buffer, bs, offsets[0]);
+			else
+				ret = pread(w->fd, buffer, bs, offsets[0]);
+			break;
+		case MODE_MMAP:
+			if (r->write)
+				memcpy(w->map + offsets[0], buffer, bs);
+			else
+				memcpy(buffer, w->map + offsets[0], bs);
+			ret = bs;
+			break;
+		default:
+			for (i = 0; i < per_call; i++) {
+				vecs[i].offset = offsets[i];
+				vecs[i].len = bs;
+				vecs[i].buf = (uintptr_t)(buffer + i * bs);
+				vecs[i].dir = r->write ? PCD_IO_WRITE : PCD_IO_READ;
+			}
+			io_batch.vecs = (uintptr_t)vecs;
+			io_batch.count = per_call;
+			io_batch.flags = 0;
+			ret = ioctl(w->fd, PCD_IOC_BATCH, &io_batch);
+			if (!ret) {
+				for (i = 0; i < per_call; i++) {
+					if (vecs[i].result < 0) {
+						errno = -vecs[i].result;
+						ret = -1;
+						break;
+					}
+					ret += vecs[i].result;
+				}
+			}
+			break;
+		}
+		if (ret < 0) {
+			w->error = errno;
+			break;
+		}
+		w->hist[bucket_of(now_ns() - start)]++;
+		ops += per_call;
+		bytes += ret;
+	}
+
+out:
+	w->ops = ops;
+	w->bytes = bytes;
+	free(vecs);
+	free(buffer);
+	return NULL;
+}
+
+static int open_device(const struct run *r)
+{
+	int flags;
+
+	/* devices with a write-only or read-only permission refuse other modes */
+	if (r->mode == MODE_MMAP && r->write)
+		flags = O_RDWR;
+	else
+		flags = r->write ? O_WRONLY : O_RDONLY;
+
+	return open(device, flags);
+}
+
+/* Returns the descriptor of a new snapshot of the device */
+static int take_snapshot(void)
+{
+	int fd, snap_fd;
+
+	fd = open(device, O_RDONLY);
+	if (fd < 0)
+		return -1;
+	snap_fd = ioctl(fd, PCD_IOC_SNAPSHOT);
+	close(fd);
+	return snap_fd;
+}
+
+/* Checks the whole device against its checksums, returns 0 or an errno */
+static int verify_device(void)
+{
+	struct pcd_verify v = { .offset = 0, .len = device_size };
+	int fd, error = 0;
+
+	fd = open(device, O_RDONLY);
+	if (fd < 0)
+		return errno;
+	if (ioctl(fd, PCD_IOC_VERIFY, &v))
+		error = errno;
+	else if (v.errors)
+		error = EIO;
+	close(fd);
+	return error;
+}
+
+static void print_header(int format)
+{
+	if (format == FMT_CSV)
+		printf("device,mode,pattern,dir,block_size,threads,ops,ops_per_sec,mib_per_sec,"
+		       "lat_p50_ns,lat_p90_ns,lat_p99_ns,lat_p999_ns,lat_max_ns,error\n");
+	else if (format == FMT_TEXT)
+		printf("%-6s %-5s %-6s %8s %7s %12s %10s %10s %10s %10s %10s %s\n",
+		       "mode", "pat", "dir", "bs", "threads", "ops/s", "MiB/s",
+		       "p50 ns", "p99 ns", "p999 ns", "max ns", "error");
+}
+
+static void run_one(const struct run *r, int format)
+{
+	struct worker *workers;
+	unsigned long long hist[NR_BUCKETS] = { 0 };
+	unsigned long long ops = 0, bytes = 0, calls = 0, max = 0;
+	double start, elapsed = 0, ops_s, mib_s;
+	int snap_fd = -1;
+	int error = 0;
+	int i, j;
+
+	workers = calloc(r->threads, sizeof(*workers));
+	if (!workers) {
+		perror("calloc");
+		exit(EXIT_FAILURE);
+	}
+
+	if ((off_t)r->block_size > device_size) {
+		error = EINVAL;
+		goto report;
+	}
+
+	for (i = 0; i < r->threads; i++)
+		workers[i].fd = -1;
+
+	/* before the mappings, the driver refuses snapshots of a mapped device */
+	if (snapshot) {
+		snap_fd = take_snapshot();
+		if (snap_fd < 0) {
+			error = errno;
+			goto close;
+		}
+	}
+
+	for (i = 0; i < r->threads; i++) {
+		workers[i].run = r;
+		workers[i].index = i;
+		workers[i].fd = open_device(r);
+		if (workers[i].fd < 0) {
+			error = errno;
+			goto close;
+		}
+		if (r->mode == MODE_MMAP) {
+			workers[i].map = mmap(NULL, device_size, r->write ? PROT_READ | PROT_WRITE : PROT_READ,
+					      MAP_SHARED, workers[i].fd, 0);
+			if (workers[i].map == MAP_FAILED) {
+				workers[i].map = NULL;
+				error = errno;
+				goto close;
+			}
+		}
+	}
+
+	running = 1;
+	start = now_ns();
+	for (i = 0; i < r->threads; i++)
+		pthread_create(&workers[i].thread, NULL, worker_fn, &workers[i]);
+
+	sleep(seconds);
+	running = 0;
+
+	for (i = 0; i < r->threads; i++)
+		pthread_join(workers[i].thread, NULL);
+	elapsed = (now_ns() - start) / 1e9;
+
+	for (i = 0; i < r->threads; i++) {
+		ops += workers[i].ops;
+		bytes += workers[i].bytes;
+		if (workers[i].error && !error)
+			error = workers[i].error;
+		for (j = 0; j < NR_BUCKETS; j++)
+			hist[j] += workers[i].hist[j];
+	}
+
+close:
+	for (i = 0; i < r->threads; i++) {
+		if (workers[i].map)
+			munmap(workers[i].map, device_size);
+		if (workers[i].fd >= 0)
+			close(workers[i].fd);
+	}
+	if (snap_fd >= 0)
+		close(snap_fd);
+	if (verify && !error)
+		error = verify_device();
+
+report:
+	free(workers);
+
+	for (j = 0; j < NR_BUCKETS; j++) {
+		calls += hist[j];
+		if (hist[j])
+			max = bucket_limit(j);
+	}
+	ops_s = calls ? ops / elapsed : 0;
+	mib_s = calls ? bytes / elapsed / (1024 * 1024) : 0;
+
+	switch (format) {
+	case FMT_CSV:
+		printf("%s,%s,%s,%s,%zu,%d,%llu,%.0f,%.1f,%llu,%llu,%llu,%llu,%llu,%s\n",
+		       device, mode_names[r->mode], pattern_names[r->random], dir_names[r->write],
+		       r->block_size, r->threads, ops, ops_s, mib_s,
+		       percentile(hist, calls, 0.5), percentile(hist, calls, 0.9),
+		       percentile(hist, calls, 0.99), percentile(hist, calls, 0.999), max,
+		       error ? strerror(error) : "");
+		break;
+	case FMT_JSON:
+		printf("{\"device\":\"%s\",\"mode\":\"%s\",\"pattern\":\"%s\",\"dir\":\"%s\","
+		       "\"block_size\":%zu,\"threads\":%d,\"ops\":%llu,\"ops_per_sec\":%.0f,"
+		       "\"mib_per_sec\":%.1f,\"lat_p50_ns\":%llu,\"lat_p90_ns\":%llu,"
+		       "\"lat_p99_ns\":%llu,\"lat_p999_ns\":%llu,\"lat_max_ns\":%llu,\"error\":\"%s\"}\n",
+		       device, mode_names[r->mode], pattern_names[r->random], dir_names[r->write],
+		       r->block_size, r->threads, ops, ops_s, mib_s,
+		       percentile(hist, calls, 0.5), percentile(hist, calls, 0.9),
+		       percentile(hist, calls, 0.99), percentile(hist, calls, 0.999), max,
+		       error ? strerror(error) : "");
+		break;
+	default:
+		printf("%-6s %-5s %-6s %8zu %7d %12.0f %10.1f %10llu %10llu %10llu %10llu %s\n",
+		       mode_names[r->mode], pattern_names[r->random], dir_names[r->write],
+		       r->block_size, r->threads, ops_s, mib_s,
+		       percentile(hist, calls, 0.5), percentile(hist, calls, 0.99),
+		       percentile(hist, calls, 0.999), max, error ? strerror(error) : "");
+		break;
+	}
+	fflush(stdout);
+}
+
+/* Parses a comma separated list of numbers */
+static int parse_numbers(char *arg, long *values)
+{
+	char *token;
+	int n = 0;
+
+	for (token = strtok(arg, ","); token && n < MAX_LIST; token = strtok(NULL, ",")) {
+		values[n] = strtol(token, NULL, 0);
+		if (values[n] <= 0)
+			return -1;
+		n++;
+	}
+	return n;
+}
+
+/* Parses a comma separated list of names, returns a bit mask of their indexes */
+static int parse_names(char *arg, const char **names, int nr_names)
+{
+	char *token;
+	int mask = 0;
+	int i;
+
+	for (token = strtok(arg, ","); token; token = strtok(NULL, ",")) {
+		for (i = 0; i < nr_names; i++) {
+			if (!strcmp(token, names[i]))
+				break;
+		}
+		if (i == nr_names)
+			return -1;
+		mask |= 1 << i;
+	}
+	return mask;
+}
+
+static void usage(const char *name)
+{
+	printf("Correct usage: %s [-d device] [-m rw,mmap,batch] [-p seq,rand] [-o read,write]\n"
+	       "       [-b block_sizes] [-t threads] [-s seconds] [-n batch] [-f text|csv|json] [-S] [-V]\n", name);
+}
+
+int main(int argc, char *argv[])
+{
+	long block_sizes[MAX_LIST] = { 512, 4096, 65536 };
+	long threads[MAX_LIST] = { 1 };
+	int nr_block_sizes = 3, nr_threads = 1;
+	int modes = 1 << MODE_RW, patterns = 3, dirs = 3;
+	int format = FMT_TEXT;
+	struct run r;
+	int opt, fd, b, t;
+
+	while ((opt = getopt(argc, argv, "d:m:p:o:b:t:s:n:f:SV")) != -1) {
+		switch (opt) {
+		case 'd':
+			device = optarg;
+			break;
+		case 'm':
+			modes = parse_names(optarg, mode_names, 3);
+			break;
+		case 'p':
+			patterns = parse_names(optarg, pattern_names, 2);
+			break;
+		case 'o':
+			dirs = parse_names(optarg, dir_names, 2);
+			break;
+		case 'b':
+			nr_block_sizes = parse_numbers(optarg, block_sizes);
+			break;
+		case 't':
+			nr_threads = parse_numbers(optarg, threads);
+			break;
+		case 's':
+			seconds = atoi(optarg);
+			break;
+		case 'n':
+			batch = atoi(optarg);
+			break;
+		case 'S':
+			snapshot = 1;
+			break;
+		case 'V':
+			verify = 1;
+			break;
+		case 'f':
+			if (!strcmp(optarg, "csv"))
+				format = FMT_CSV;
+			else if (!strcmp(optarg, "json"))
+				format = FMT_JSON;
+			else if (!strcmp(optarg, "text"))
+				format = FMT_TEXT;
+			else
+				format = -1;
+			break;
+		default:
+			usage(argv[0]);
+			return EXIT_FAILURE;
+		}
+	}
+
+	if (modes <= 0 || patterns <= 0 || dirs <= 0 || nr_block_sizes <= 0 || nr_threads <= 0 ||
+	    seconds < 1 || batch < 1 || batch > PCD_IO_BATCH_MAX || format < 0) {
+		printf("Wrong arguments\n");
+		usage(argv[0]);
+		return EXIT_FAILURE;
+	}
+
+	/* every driver supports SEEK_END */
+	fd = open(device, O_RDONLY);
+	if (fd < 0)
+		fd = open(device, O_WRONLY);
+	if (fd < 0) {
+		perror("open");
+		return EXIT_FAILURE;
+	}
+	device_size = lseek(fd, 0, SEEK_END);
+	close(fd);
+	if (device_size <= 0) {
+		printf("Cannot determine the size of %s\n", device);
+		return EXIT_FAILURE;
+	}
+
+	if (format == FMT_TEXT)
+		printf("device %s, size %lld, %d s per run\n", device, (long long)device_size, seconds);
+	print_header(format);
+
+	for (r.mode = 0; r.mode < 3; r.mode++) {
+		if (!(modes & (1 << r.mode)))
+			continue;
+		for (r.random = 0; r.random < 2; r.random++) {
+			if (!(patterns & (1 << r.random)))
+				continue;
+			for (r.write = 0; r.write < 2; r.write++) {
+				if (!(dirs & (1 << r.write)))
+					continue;
+				for (b = 0; b < nr_block_sizes; b++) {
+					for (t = 0; t < nr_threads; t++) {
+						r.block_size = block_sizes[b];
+						r.threads = threads[t];
+						run_one(&r, format);
+					}
+				}
+			}
+		}
+	}
+
+	return 0;
+}
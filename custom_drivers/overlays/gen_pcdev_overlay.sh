@@ -0,0 +1,44 @@
+#!/bin/sh
+# Generates an overlay with N pcdev nodes, used to measure how long it takes
+# to probe many devices at boot.
+#
+# Usage: ./gen_pcdev_overlay.sh [N] [size] > PCDEV_MANY.dts
+#        dtc -@ -I dts -O dtb -o PCDEV_MANY.dtbo PCDEV_MANY.dts
+#
+# Every node needs about 150 bytes in the final device tree, so raise
+# "fdt resize" in uEnv-dtbo.txt accordingly (e.g. 65536 for 256 nodes).
+#
+# After boot the driver reports the probe times in /sys/kernel/debug/pcd/probe,
+# last_done_ns is the boot-to-all-devices-ready time.
+
+N=${1:-256}
+SIZE=${2:-4096}
+
+cat <<EOF
+/dts-v1/;
+/plugin/;
+
+/{
+    fragment@0 {
+        target-path = "/";
+        __overlay__ {
+EOF
+
+i=0
+while [ "$i" -lt "$N" ]; do
+    cat <<EOF
+            pcdev-many-$i {
+                compatible = "pcdev-A1x";
+                org,size = <$SIZE>;
+                org,perm = <0x11>;
+                org,device-serial-num = "PCDEVMANY$i";
+            };
+EOF
+    i=$((i + 1))
+done
+
+cat <<EOF
+        };
+    };
+};
+EOF
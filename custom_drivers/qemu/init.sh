@@ -0,0 +1,359 @@
+#!/bin/sh
+# /init of the QEMU test image (see Makefile).
+#
+# Loads every module, runs its functional tests and benchmarks, unloads it
+# again and powers the machine off. Results are printed on the console as
+#   PCDTEST: PASS|FAIL|SKIP <test> [reason]
+#   PCDBENCH: <module>,<pcd_bench csv line>
+#   PCDSTRESS: <pcd_stress output line>
+#   PCDZSTORE: <line of the compression attribute of a compressed device>
+#   PCDCSUM: <line of the checksum attribute of a device with checksums>
+#   PCDPROBE: <probe time of the DT devices or open time of a device>
+# and collected on the host by report.sh. Kernel messages are kept off the
+# console, they are dumped at the end instead.
+
+mount -t devtmpfs devtmpfs /dev
+exec 0</dev/console 1>/dev/console 2>&1
+mount -t proc proc /proc
+mount -t sysfs sysfs /sys
+mount -t debugfs debugfs /sys/kernel/debug
+mount -t configfs configfs /sys/kernel/config
+mount -t tmpfs tmpfs /tmp
+echo 1 > /proc/sys/kernel/printk
+
+# ARCH, BENCH_ARGS, generated by the Makefile
+. /etc/pcd-test.conf
+
+MODDIR=/lib/modules
+CLASS=/sys/class/pcd_class
+
+pass()
+{
+    echo "PCDTEST: PASS $1"
+}
+
+fail()
+{
+    echo "PCDTEST: FAIL $1${2:+ ($2)}"
+}
+
+skip()
+{
+    echo "PCDTEST: SKIP $1${2:+ ($2)}"
+}
+
+# check <test> <command...>: runs the command, its last output line is the
+# reason of a failure
+check()
+{
+    name=$1
+    shift
+    if out=$("$@" 2>&1); then
+        pass "$name"
+    else
+        fail "$name" "$(echo "$out" | tail -n 1)"
+    fi
+}
+
+# waits up to 5 s for a file to appear, the DT driver probes asynchronously
+wait_for()
+{
+    i=0
+    while [ ! -e "$1" ] && [ $i -lt 50 ]; do
+        sleep 0.1
+        i=$((i + 1))
+    done
+    [ -e "$1" ]
+}
+
+# writes <size> random bytes at offset 0 of <dev> and reads them back
+roundtrip()
+{
+    dd if=/dev/urandom of=/tmp/in bs="$2" count=1 2>/dev/null &&
+    dd if=/tmp/in of="$1" bs="$2" count=1 conv=notrunc 2>/dev/null &&
+    dd if="$1" of=/tmp/out bs="$2" count=1 iflag=fullblock 2>/dev/null &&
+    cmp /tmp/in /tmp/out
+}
+
+# a write of <bs> bytes at block <seek> of <dev> has to fail
+write_fails()
+{
+    ! dd if=/dev/zero of="$1" bs="$2" count=1 seek="$3" conv=notrunc 2>/dev/null
+}
+
+read_fails()
+{
+    ! dd if="$1" of=/dev/null bs=1 count=1 2>/dev/null
+}
+
+# bench <module> <pcd_bench arguments...>
+bench()
+{
+    tag=$1
+    shift
+    pcd_bench -f csv "$@" 2>&1 | sed -e "1s/^/module,/" -e "1!s/^/$tag,/" -e "s/^/PCDBENCH: /"
+}
+
+# reads a DT cell property as a number
+dt_number()
+{
+    echo $((0x$(od -An -tx1 -v "$1" | tr -d ' \n')))
+}
+
+test_001()
+{
+    check 001.load insmod $MODDIR/main.ko
+    check 001.unload rmmod main
+}
+
+test_002()
+{
+    check 002.load insmod $MODDIR/pcd.ko
+    check 002.roundtrip roundtrip /dev/pcd 512
+    check 002.write_past_end write_fails /dev/pcd 512 1
+    check 002.unload rmmod pcd
+}
+
+test_003()
+{
+    check 003.load insmod $MODDIR/pcd_n.ko
+    check 003.roundtrip roundtrip /dev/pcdev-2 1024
+    check 003.rdonly_write write_fails /dev/pcdev-0 1 0
+    check 003.wronly_read read_fails /dev/pcdev-1
+    check 003.write_past_end write_fails /dev/pcdev-3 512 1
+    pcd_stress -d /dev/pcdev-2 -s 1 -w 1 2>&1 | sed "s/^/PCDSTRESS: /"
+    check 003.unload rmmod pcd_n
+}
+
+test_004()
+{
+    check 004.load insmod $MODDIR/pcd_platform_driver.ko
+    check 004.setup insmod $MODDIR/pcd_device_setup.ko
+    check 004.devices wait_for /dev/pcdev-3
+    check 004.roundtrip roundtrip /dev/pcdev-1 1024
+    check 004.rdonly_write write_fails /dev/pcdev-2 1 0
+    check 004.wronly_read read_fails /dev/pcdev-3
+    check 004.write_past_end write_fails /dev/pcdev-0 512 1
+    bench 004 -d /dev/pcdev-1 -m rw,mmap -b 512 -t 1,2 -s 1
+    check 004.unsetup rmmod pcd_device_setup
+    check 004.unload rmmod pcd_platform_driver
+}
+
+# prints the pcdev that is not in the list <before> once it shows up
+new_device()
+{
+    i=0
+    while [ $i -lt 50 ]; do
+        for d in $(ls $CLASS); do
+            if ! echo "$1" | grep -qx "$d" && [ -e /dev/$d ]; then
+                echo $d
+                return 0
+            fi
+        done
+        sleep 0.1
+        i=$((i + 1))
+    done
+    return 1
+}
+
+# prints the enabled pcdev DT nodes
+dt_nodes()
+{
+    for node in /proc/device-tree/pcdev*; do
+        [ -e "$node/status" ] && [ "$(tr -d '\0' < "$node/status")" = disabled ] && continue
+        echo $node
+    done
+}
+
+# waits up to 30 s until the driver has probed <n> devices, the arm image
+# has hundreds of DT nodes from gen_pcdev_overlay.sh
+wait_for_probe()
+{
+    i=0
+    while [ $i -lt 300 ]; do
+        probed=$(sed -n 's/^devices //p' /sys/kernel/debug/pcd/probe)
+        [ "${probed:-0}" -ge "$1" ] && return 0
+        sleep 0.1
+        i=$((i + 1))
+    done
+    return 1
+}
+
+# every enabled pcdev DT node has a device of the size given in the DT
+dt_devices()
+{
+    # serial number and device of every DT device, looked up once instead of
+    # once per node
+    for dev in $CLASS/pcdev-*; do
+        of=$dev/device/of_node
+        [ -e "$of/org,device-serial-num" ] || continue
+        echo "$(tr -d '\0' < "$of/org,device-serial-num") $dev"
+    done > /tmp/dt_serials
+
+    for node in $(dt_nodes); do
+        serial=$(tr -d '\0' < "$node/org,device-serial-num")
+        found=$(sed -n "s|^$serial ||p" /tmp/dt_serials)
+        if [ -z "$found" ]; then
+            echo "no device for $node"
+            return 1
+        fi
+        if [ "$(cat "$found/size")" != "$(dt_number "$node/org,size")" ]; then
+            echo "wrong size of $found"
+            return 1
+        fi
+    done
+}
+
+# opens every readable DT device ten times, the average includes the shell
+# overhead of the redirection
+dt_open_time()
+{
+    opens=0
+    start=$(date +%s%N)
+    for round in 1 2 3 4 5 6 7 8 9 10; do
+        while read -r serial dev; do
+            true 2>/dev/null < /dev/${dev##*/} && opens=$((opens + 1))
+        done < /tmp/dt_serials
+    done
+    end=$(date +%s%N)
+    echo "PCDPROBE: opens $opens"
+    echo "PCDPROBE: open_avg_ns $(( (end - start) / (opens > 0 ? opens : 1) ))"
+}
+
+test_005()
+{
+    cfs=/sys/kernel/config/pcd/bench
+
+    check 005.load insmod $MODDIR/pcd_platform_driver_dt.ko blkdev=1
+    check 005.probe_debugfs test -r /sys/kernel/debug/pcd/probe
+    if [ -d /proc/device-tree ]; then
+        nodes=$(dt_nodes | wc -l)
+        wait_for_probe $nodes
+        check 005.dt_devices dt_devices
+        echo "PCDPROBE: nodes $nodes"
+        sed "s/^/PCDPROBE: /" /sys/kernel/debug/pcd/probe
+        dt_open_time
+    else
+        skip 005.dt_devices "no device tree"
+    fi
+
+    before=$(ls $CLASS)
+    check 005.configfs_create mkdir $cfs
+    echo 16777216 > $cfs/size
+    echo 0x11 > $cfs/perm
+    echo linear > $cfs/mode
+    echo PCDEVBENCH01 > $cfs/serial_number
+    check 005.configfs_enable sh -c "echo 1 > $cfs/enable"
+
+    if dev=$(new_device "$before"); then
+        pass 005.configfs_device
+        check 005.roundtrip roundtrip /dev/$dev 65536
+        blk=/dev/pcdblk${dev#pcdev-}
+        # O_DIRECT, the page cache of the block device does not see char device writes
+        check 005.blk_shared sh -c "dd if=$blk bs=65536 count=1 iflag=direct 2>/dev/null | cmp - /tmp/in"
+        check 005.blk_roundtrip roundtrip $blk 65536
+        check 005.write_past_end write_fails /dev/$dev 16777216 1
+        check 005.stats test -n "$(cat $CLASS/$dev/stats)"
+        check 005.resize_grow sh -c "echo 33554432 > $CLASS/$dev/size && [ \$(cat $CLASS/$dev/size) = 33554432 ]"
+        check 005.resize_keeps_data sh -c "dd if=/dev/$dev bs=65536 count=1 2>/dev/null | cmp - /tmp/in"
+        check 005.resize_shrink sh -c "echo 16777216 > $CLASS/$dev/size && [ \$(cat $CLASS/$dev/size) = 16777216 ]"
+        bench 005 -d /dev/$dev $BENCH_ARGS
+        bench 005blk -d $blk -m rw,mmap -p seq,rand -o read,write -b 4096,65536 -t 1,2,4 -s 1
+        # the same writes while a snapshot has to preserve the pages they touch
+        bench 005snap -d /dev/$dev -S -m rw,mmap -p seq,rand -o write -b 4096,65536 -t 1,4 -s 1
+    else
+        fail 005.configfs_device "no device appeared"
+    fi
+
+    check 005.configfs_disable sh -c "echo 0 > $cfs/enable"
+    check 005.configfs_remove rmdir $cfs
+
+    # contents written to a device with a backing file come back with the next device
+    cfs=/sys/kernel/config/pcd/persist
+    mkdir $cfs
+    echo 1048576 > $cfs/size
+    echo /tmp/pcd-persist.img > $cfs/backing_file
+    before=$(ls $CLASS)
+    echo 1 > $cfs/enable
+    if dev=$(new_device "$before"); then
+        check 005.persist_write roundtrip /dev/$dev 65536
+        echo 0 > $cfs/enable
+        check 005.persist_file sh -c "dd if=/tmp/pcd-persist.img bs=65536 count=1 2>/dev/null | cmp - /tmp/in"
+        before=$(ls $CLASS)
+        echo 1 > $cfs/enable
+        if dev=$(new_device "$before"); then
+            check 005.persist_reattach sh -c "dd if=/dev/$dev bs=65536 count=1 2>/dev/null | cmp - /tmp/in"
+        else
+            fail 005.persist_reattach "no device appeared"
+        fi
+        echo 0 > $cfs/enable
+    else
+        fail 005.persist_write "no device appeared"
+    fi
+    rmdir $cfs
+
+    # cold pages of a compressed device are compressed after two scans and
+    # read back unchanged
+    cfs=/sys/kernel/config/pcd/zstore
+    params=/sys/module/pcd_platform_driver_dt/parameters
+    compress_ms=$(cat $params/compress_ms)
+    echo 200 > $params/compress_ms
+    mkdir $cfs
+    echo 4194304 > $cfs/size
+    echo lz4 > $cfs/compress
+    before=$(ls $CLASS)
+    echo 1 > $cfs/enable
+    if dev=$(new_device "$before"); then
+        yes pcdev | head -c 1048576 > /tmp/zin
+        dd if=/tmp/zin of=/dev/$dev bs=65536 conv=notrunc 2>/dev/null
+        sleep 1
+        check 005.zstore_compressed sh -c "[ \$(sed -n 's/^compressed_pages //p' $CLASS/$dev/compression) -gt 0 ]"
+        check 005.zstore_readback sh -c "dd if=/dev/$dev bs=65536 count=16 2>/dev/null | cmp - /tmp/zin"
+        sed "s/^/PCDZSTORE: /" $CLASS/$dev/compression
+        echo 0 > $cfs/enable
+    else
+        fail 005.zstore_compressed "no device appeared"
+    fi
+    rmdir $cfs
+    echo $compress_ms > $params/compress_ms
+
+    # reads, the scrubber and PCD_IOC_VERIFY (pcd_bench -V) find no damage
+    # after writes through both front ends. The benches repeat runs of the
+    # bench device, report.sh compares them
+    cfs=/sys/kernel/config/pcd/csum
+    scrub_ms=$(cat $params/scrub_ms)
+    echo 200 > $params/scrub_ms
+    mkdir $cfs
+    echo 16777216 > $cfs/size
+    echo 1 > $cfs/checksum
+    before=$(ls $CLASS)
+    echo 1 > $cfs/enable
+    if dev=$(new_device "$before"); then
+        blk=/dev/pcdblk${dev#pcdev-}
+        check 005.csum_roundtrip roundtrip /dev/$dev 65536
+        check 005.csum_blk_roundtrip roundtrip $blk 65536
+        sleep 1
+        check 005.csum_scrub sh -c "[ \$(sed -n 's/^scrubs //p' $CLASS/$dev/checksum) -gt 0 ]"
+        # the next scrub only comes after the benches
+        echo $scrub_ms > $params/scrub_ms
+        bench 005csumblk -d $blk -m rw -p seq,rand -o read,write -b 4096,65536 -t 1,2,4 -s 1
+        bench 005csum -d /dev/$dev -V -m rw -p seq,rand -o read,write -b 512,4096,65536 -t 1,2,4 -s 1
+        check 005.csum_errors sh -c "[ \$(sed -n 's/^errors //p' $CLASS/$dev/checksum) -eq 0 ]"
+        sed "s/^/PCDCSUM: /" $CLASS/$dev/checksum
+        echo 0 > $cfs/enable
+    else
+        fail 005.csum_roundtrip "no device appeared"
+    fi
+    rmdir $cfs
+    echo $scrub_ms > $params/scrub_ms
+    check 005.unload rmmod pcd_platform_driver_dt
+}
+
+echo "PCDTEST: START $ARCH $(uname -r) $(nproc) cpu(s)"
+for t in 001 002 003 004 005; do
+    test_$t
+done
+dmesg | sed "s/^/PCDKMSG: /"
+echo "PCDTEST: DONE"
+
+poweroff -f
@@ -0,0 +1,66 @@
+#!/bin/sh
+# Collects the results of a test run from the console log written by the
+# Makefile and prints a summary.
+#
+# Usage: ./report.sh <results directory>
+#
+# Writes summary.txt (test results), bench.csv (pcd_bench results of all
+# modules), stress.txt (pcd_stress output), zstore.txt (compression results
+# of the DT driver), csum.txt (checksum results of the DT driver), csum.csv
+# (throughput with and without checksums), probe.txt (probe and open times
+# of the DT devices) and dmesg.txt to the directory.
+# Exits with 1 when a test failed or the run did not complete.
+
+DIR=${1:?results directory}
+LOG=$DIR/console.log
+
+if [ ! -f "$LOG" ]; then
+    echo "No console log in $DIR"
+    exit 1
+fi
+
+# serial consoles end lines with \r\n
+tr -d '\r' < "$LOG" > "$DIR/console.txt"
+
+sed -n 's/^PCDTEST: //p' "$DIR/console.txt" > "$DIR/summary.txt"
+sed -n 's/^PCDBENCH: //p' "$DIR/console.txt" | awk '!(/^module,/ && seen++)' > "$DIR/bench.csv"
+sed -n 's/^PCDSTRESS: //p' "$DIR/console.txt" > "$DIR/stress.txt"
+sed -n 's/^PCDZSTORE: //p' "$DIR/console.txt" > "$DIR/zstore.txt"
+sed -n 's/^PCDCSUM: //p' "$DIR/console.txt" > "$DIR/csum.txt"
+sed -n 's/^PCDPROBE: //p' "$DIR/console.txt" > "$DIR/probe.txt"
+sed -n 's/^PCDKMSG: //p' "$DIR/console.txt" > "$DIR/dmesg.txt"
+rm -f "$DIR/console.txt"
+
+# the runs of the checksummed device next to the same runs of the plain one
+awk -F, '
+    $1 == "005" || $1 == "005blk" {
+        plain[($1 == "005" ? "char" : "blk") FS $3 FS $4 FS $5 FS $6 FS $7] = $10
+    }
+    $1 == "005csum" || $1 == "005csumblk" {
+        key = ($1 == "005csum" ? "char" : "blk") FS $3 FS $4 FS $5 FS $6 FS $7
+        csum[key] = $10
+        keys[n++] = key
+    }
+    END {
+        print "front,mode,pattern,dir,block_size,threads,mib_per_sec,csum_mib_per_sec,overhead_pct"
+        for (i = 0; i < n; i++) {
+            if (plain[keys[i]] > 0)
+                printf "%s,%.1f,%.1f,%.1f\n", keys[i], plain[keys[i]], csum[keys[i]],
+                       (plain[keys[i]] - csum[keys[i]]) * 100 / plain[keys[i]]
+        }
+    }' "$DIR/bench.csv" > "$DIR/csum.csv"
+
+passed=$(grep -c '^PASS ' "$DIR/summary.txt")
+failed=$(grep -c '^FAIL ' "$DIR/summary.txt")
+skipped=$(grep -c '^SKIP ' "$DIR/summary.txt")
+
+grep -v '^PASS ' "$DIR/summary.txt"
+[ -s "$DIR/probe.txt" ] && tr '\n' ' ' < "$DIR/probe.txt" && echo
+echo "$passed passed, $failed failed, $skipped skipped, results in $DIR"
+
+if ! grep -q '^DONE' "$DIR/summary.txt"; then
+    echo "The test run did not complete, see $LOG"
+    exit 1
+fi
+
+[ "$failed" -eq 0 ]